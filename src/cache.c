@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "include/nfa.h"
+#include "include/cache.h"
+
+
+/* Bump whenever the layout of the cache file or of nfa images changes */
+#define CACHE_FORMAT_VERSION    3
+
+#define CACHE_MAGIC     "PERGNFA"
+
+#define CACHE_ALIGN     16
+
+
+/* A cache file is this header, followed by the expression (to guard against
+ * hash collisions), followed by a flattened nfa image at image_offset. The
+ * whole file is mapped at once, and the image relocated in place, so loading
+ * a cached expression does no parsing and no allocation. */
+typedef struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_flags;
+    uint32_t state_size;        /* images depend on the layout of the structs */
+    uint32_t transition_size;
+    uint64_t expr_len;
+    uint64_t image_offset;
+    uint64_t image_size;
+} cache_header_t;
+
+
+uint64_t fnv1a(uint64_t hash, void *data, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= ((unsigned char *)data)[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+
+/* Writes the cache directory into path, creating it if create is nonzero.
+ * Uses $XDG_CACHE_HOME/perg, or $HOME/.cache/perg if that is unset.
+ * Returns 0 on success, or -1 if there is no usable cache directory. */
+int cache_dir(char *path, size_t pathsize, int create) {
+    char *base = getenv("XDG_CACHE_HOME");
+    size_t len;
+    if (base != NULL && base[0] != '\0') {
+        len = snprintf(path, pathsize, "%s", base);
+    } else {
+        if ((base = getenv("HOME")) == NULL || base[0] == '\0')
+            return -1;
+        len = snprintf(path, pathsize, "%s/.cache", base);
+    }
+    if (len >= pathsize)
+        return -1;
+    if (create && mkdir(path, 0700) == -1 && errno != EEXIST)
+        return -1;
+    if (snprintf(path + len, pathsize - len, "/perg") >= (int)(pathsize - len))
+        return -1;
+    if (create && mkdir(path, 0700) == -1 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+
+/* Writes the path of the cache file for the expression and key flags, which
+ * is named by a hash of them and of the format version */
+int cache_path(char *path, size_t pathsize, char *expression, int key_flags, int create) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint32_t version = CACHE_FORMAT_VERSION, flags = key_flags;
+    size_t len;
+    if (cache_dir(path, pathsize, create) != 0)
+        return -1;
+    hash = fnv1a(hash, &version, sizeof(version));
+    hash = fnv1a(hash, &flags, sizeof(flags));
+    hash = fnv1a(hash, expression, strlen(expression));
+    len = strlen(path);
+    if (snprintf(path + len, pathsize - len, "/%016llx", (unsigned long long)hash)
+            >= (int)(pathsize - len))
+        return -1;
+    return 0;
+}
+
+
+/* Returns the cached nfa for the expression and key flags, or NULL if there
+ * is no valid cache entry for them */
+nfa_t *load_cached_nfa(char *expression, int key_flags) {
+    char path[PATH_MAX], *block;
+    cache_header_t *header;
+    struct stat st;
+    nfa_t *nfa;
+    size_t expr_len = strlen(expression);
+    int fd;
+    if (cache_path(path, sizeof(path), expression, key_flags, 0) != 0)
+        return NULL;
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(cache_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    /* Private mapping, so relocation only copies the pages it touches, and
+     * never modifies the file */
+    block = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED)
+        return NULL;
+    header = (cache_header_t *)block;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != CACHE_FORMAT_VERSION ||
+            header->key_flags != (uint32_t)key_flags ||
+            header->state_size != sizeof(state_t) ||
+            header->transition_size != sizeof(transition_t) ||
+            header->expr_len != expr_len ||
+            sizeof(cache_header_t) + expr_len > header->image_offset ||
+            header->image_offset % CACHE_ALIGN != 0 ||
+            header->image_offset > (uint64_t)st.st_size ||
+            header->image_size != (uint64_t)st.st_size - header->image_offset ||
+            memcmp(block + sizeof(cache_header_t), expression, expr_len) != 0)
+        goto INVALID_ENTRY;
+    nfa = relocate_nfa(block + header->image_offset, header->image_size,
+                       NFA_STORAGE_MAPPED, block, st.st_size);
+    if (nfa == NULL)
+        goto INVALID_ENTRY;
+    return nfa;
+INVALID_ENTRY:
+    munmap(block, st.st_size);
+    return NULL;
+}
+
+
+/* Stores the freshly built nfa in the cache. The cache is only an
+ * optimization, so any failure leaves it untouched and is not reported. The
+ * entry is written to a temporary file and renamed into place, so that
+ * concurrent runs never map a partially written entry. */
+void store_cached_nfa(nfa_t *nfa, char *expression, int key_flags) {
+    char path[PATH_MAX], tmp_path[PATH_MAX], padding[CACHE_ALIGN], *image;
+    cache_header_t header;
+    size_t image_size, pad_len;
+    FILE *outfile;
+    int fd;
+    if (cache_path(path, sizeof(path), expression, key_flags, 1) != 0)
+        return;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= (int)sizeof(tmp_path))
+        return;
+    if ((fd = mkstemp(tmp_path)) == -1)
+        return;
+    if ((outfile = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    image_size = flatten_nfa(nfa, &image);
+    memset(&header, 0, sizeof(header));
+    memset(padding, 0, sizeof(padding));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_FORMAT_VERSION;
+    header.key_flags = key_flags;
+    header.state_size = sizeof(state_t);
+    header.transition_size = sizeof(transition_t);
+    header.expr_len = strlen(expression);
+    pad_len = (CACHE_ALIGN - (sizeof(header) + header.expr_len) % CACHE_ALIGN) % CACHE_ALIGN;
+    header.image_offset = sizeof(header) + header.expr_len + pad_len;
+    header.image_size = image_size;
+    fwrite(&header, sizeof(header), 1, outfile);
+    fwrite(expression, sizeof(char), header.expr_len, outfile);
+    fwrite(padding, sizeof(char), pad_len, outfile);
+    fwrite(image, sizeof(char), image_size, outfile);
+    free(image);
+    if (ferror(outfile)) {
+        fclose(outfile);
+        unlink(tmp_path);
+        return;
+    }
+    if (fclose(outfile) != 0 || rename(tmp_path, path) == -1)
+        unlink(tmp_path);
+}
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "include/nfa.h"
+#include "include/cache.h"
+#include "include/checkpoint.h"
+
+
+#define CHECKPOINT_HEADER   "perg checkpoint 1\n"
+
+/* Bytes at the start of a file, and just before its checkpointed offset,
+ * whose hash must be unchanged for the file to be resumed */
+#define FINGERPRINT_BYTES   4096
+
+#define CHECKPOINT_INITIAL_BUCKETS  256
+
+
+/* Stream over the part of a file not yet covered by its checkpoint, ending
+ * after the last complete line the file had when it was opened. Closing
+ * the stream records how far it was read in the checkpoint entry. */
+typedef struct checkpointed_file {
+    FILE *infile;
+    checkpoint_entry_t *entry;
+    off_t offset;               /* next byte to read */
+    off_t end;
+    unsigned long long lines;   /* newlines before offset */
+} checkpointed_file_t;
+
+
+uint64_t hash_path(char *path) {
+    return fnv1a(FNV_OFFSET_BASIS, path, strlen(path));
+}
+
+
+void insert_entry(checkpoint_t *checkpoint, checkpoint_entry_t *entry) {
+    checkpoint_entry_t **buckets, *next;
+    size_t i, bucket;
+    if (checkpoint->entry_count >= checkpoint->bucket_count) {
+        /* rehash into twice as many buckets */
+        buckets = calloc(checkpoint->bucket_count * 2, sizeof(checkpoint_entry_t *));
+        for (i = 0; i < checkpoint->bucket_count; i++) {
+            for (; checkpoint->buckets[i] != NULL; checkpoint->buckets[i] = next) {
+                next = checkpoint->buckets[i]->next;
+                bucket = hash_path(checkpoint->buckets[i]->path) % (checkpoint->bucket_count * 2);
+                checkpoint->buckets[i]->next = buckets[bucket];
+                buckets[bucket] = checkpoint->buckets[i];
+            }
+        }
+        free(checkpoint->buckets);
+        checkpoint->buckets = buckets;
+        checkpoint->bucket_count *= 2;
+    }
+    bucket = hash_path(entry->path) % checkpoint->bucket_count;
+    entry->next = checkpoint->buckets[bucket];
+    checkpoint->buckets[bucket] = entry;
+    checkpoint->entry_count++;
+}
+
+
+/* Returns the entry for path, adding an empty one if there is none. Takes
+ * ownership of path. */
+checkpoint_entry_t *find_entry(checkpoint_t *checkpoint, char *path) {
+    checkpoint_entry_t *entry;
+    for (entry = checkpoint->buckets[hash_path(path) % checkpoint->bucket_count];
+            entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) {
+            free(path);
+            return entry;
+        }
+    }
+    entry = calloc(1, sizeof(checkpoint_entry_t));
+    entry->path = path;
+    insert_entry(checkpoint, entry);
+    return entry;
+}
+
+
+/* Returns a new checkpoint holding the entries in filename, which need not
+ * exist yet. Returns NULL if filename exists but is not a checkpoint. */
+checkpoint_t *load_checkpoint(char *filename) {
+    checkpoint_t *checkpoint;
+    checkpoint_entry_t *entry;
+    FILE *infile;
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+    int path_start;
+    checkpoint = malloc(sizeof(checkpoint_t));
+    checkpoint->filename = filename;
+    checkpoint->bucket_count = CHECKPOINT_INITIAL_BUCKETS;
+    checkpoint->buckets = calloc(checkpoint->bucket_count, sizeof(checkpoint_entry_t *));
+    checkpoint->entry_count = 0;
+    if ((infile = fopen(filename, "r")) == NULL)
+        return checkpoint;
+    if (getline(&line, &linesize, infile) == -1 || strcmp(line, CHECKPOINT_HEADER) != 0) {
+        fprintf(stderr, "ERROR: not a checkpoint file: %s\n", filename);
+        free(line);
+        fclose(infile);
+        free_checkpoint(checkpoint);
+        return NULL;
+    }
+    /* each line is: device inode offset lines fingerprint path */
+    while ((len = getline(&line, &linesize, infile)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        entry = calloc(1, sizeof(checkpoint_entry_t));
+        path_start = 0;
+        sscanf(line, "%llu %llu %llu %llu %llx %n", &entry->dev, &entry->ino,
+               &entry->offset, &entry->lines, &entry->fingerprint, &path_start);
+        if (path_start == 0 || line[path_start] == '\0') {
+            free(entry);    /* skip malformed lines */
+            continue;
+        }
+        entry->path = malloc(strlen(line + path_start) + 1);
+        strcpy(entry->path, line + path_start);
+        insert_entry(checkpoint, entry);
+    }
+    free(line);
+    fclose(infile);
+    return checkpoint;
+}
+
+
+/* Replaces the checkpoint file with the current entries. Returns 0 on
+ * success, or -1 if it could not be written. */
+int save_checkpoint(checkpoint_t *checkpoint) {
+    char tmp_path[PATH_MAX];
+    checkpoint_entry_t *entry;
+    FILE *outfile;
+    size_t i;
+    int fd;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", checkpoint->filename)
+            >= (int)sizeof(tmp_path))
+        goto WRITE_ERROR;
+    if ((fd = mkstemp(tmp_path)) == -1)
+        goto WRITE_ERROR;
+    if ((outfile = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(tmp_path);
+        goto WRITE_ERROR;
+    }
+    fputs(CHECKPOINT_HEADER, outfile);
+    for (i = 0; i < checkpoint->bucket_count; i++) {
+        for (entry = checkpoint->buckets[i]; entry != NULL; entry = entry->next) {
+            /* entries are one per line, so skip any path which would break that */
+            if (strchr(entry->path, '\n') != NULL)
+                continue;
+            fprintf(outfile, "%llu %llu %llu %llu %llx %s\n", entry->dev, entry->ino,
+                    entry->offset, entry->lines, entry->fingerprint, entry->path);
+        }
+    }
+    if (ferror(outfile)) {
+        fclose(outfile);
+        unlink(tmp_path);
+        goto WRITE_ERROR;
+    }
+    if (fclose(outfile) != 0 || rename(tmp_path, checkpoint->filename) == -1) {
+        unlink(tmp_path);
+        goto WRITE_ERROR;
+    }
+    return 0;
+WRITE_ERROR:
+    fprintf(stderr, "ERROR: could not write checkpoint: %s\n", checkpoint->filename);
+    return -1;
+}
+
+
+void free_checkpoint(checkpoint_t *checkpoint) {
+    checkpoint_entry_t *entry;
+    size_t i;
+    for (i = 0; i < checkpoint->bucket_count; i++) {
+        while ((entry = checkpoint->buckets[i]) != NULL) {
+            checkpoint->buckets[i] = entry->next;
+            free(entry->path);
+            free(entry);
+        }
+    }
+    free(checkpoint->buckets);
+    free(checkpoint);
+}
+
+
+/* Returns a hash of the first FINGERPRINT_BYTES of the file, and of the
+ * FINGERPRINT_BYTES before offset, or 0 if they could not be read */
+uint64_t fingerprint(int fd, off_t offset) {
+    char block[FINGERPRINT_BYTES];
+    uint64_t hash = FNV_OFFSET_BASIS;
+    size_t len = (offset < FINGERPRINT_BYTES) ? offset : FINGERPRINT_BYTES;
+    if (pread(fd, block, len, 0) != (ssize_t)len)
+        return 0;
+    hash = fnv1a(hash, block, len);
+    if (offset > FINGERPRINT_BYTES) {
+        if (pread(fd, block, len, offset - len) != (ssize_t)len)
+            return 0;
+        hash = fnv1a(hash, block, len);
+    }
+    return hash;
+}
+
+
+/* Returns the offset just past the last newline between start and size, or
+ * start if there is none, so that a line still being written is left for
+ * the next search */
+off_t end_of_last_line(int fd, off_t start, off_t size) {
+    char block[FINGERPRINT_BYTES], *newline;
+    off_t block_start;
+    ssize_t bytes;
+    while (size > start) {
+        block_start = (size - start > FINGERPRINT_BYTES) ? size - FINGERPRINT_BYTES : start;
+        bytes = pread(fd, block, size - block_start, block_start);
+        if (bytes != size - block_start)
+            return start;
+        if ((newline = memrchr(block, '\n', bytes)) != NULL)
+            return block_start + (newline - block) + 1;
+        size = block_start;
+    }
+    return start;
+}
+
+
+ssize_t read_checkpointed_file(void *cookie, char *buf, size_t size) {
+    checkpointed_file_t *file = (checkpointed_file_t *)cookie;
+    ssize_t bytes;
+    char *newline;
+    if ((off_t)size > file->end - file->offset)
+        size = file->end - file->offset;
+    if (size == 0)
+        return 0;
+    do {
+        bytes = pread(fileno(file->infile), buf, size, file->offset);
+    } while (bytes < 0 && errno == EINTR);
+    if (bytes < 0)
+        return -1;
+    file->offset += bytes;
+    for (newline = buf; (newline = memchr(newline, '\n', buf + bytes - newline)) != NULL; newline++)
+        file->lines++;
+    return bytes;
+}
+
+
+int close_checkpointed_file(void *cookie) {
+    checkpointed_file_t *file = (checkpointed_file_t *)cookie;
+    struct stat st;
+    int fd = fileno(file->infile);
+    /* stdio reads ahead of the search, so only a stream read to its end,
+     * which is the end of a line, says how far the search got. Otherwise,
+     * eg. if the search stopped at binary input, the old progress is kept. */
+    if (file->offset == file->end && fstat(fd, &st) == 0) {
+        file->entry->dev = st.st_dev;
+        file->entry->ino = st.st_ino;
+        file->entry->offset = file->offset;
+        file->entry->lines = file->lines;
+        file->entry->fingerprint = fingerprint(fd, file->offset);
+    }
+    fclose(file->infile);
+    free(file);
+    return 0;
+}
+
+
+/* Returns a stream over the part of the file at path, already opened as
+ * infile, which the checkpoint has not covered yet, and stores the number
+ * of lines before it in lines_skipped. The file is read from the start if
+ * it is not the file checkpointed, or if its fingerprint has changed, eg.
+ * because it was rotated or rewritten. The stream ends after the last
+ * newline, so a final line without one is not searched until a later
+ * search finds it ended. Closing the stream closes infile and, if it was
+ * read to the end, records the new progress. If the file is not a regular
+ * file, infile is returned itself. */
+FILE *open_checkpointed(checkpoint_t *checkpoint, char *path, FILE *infile,
+                        size_t *lines_skipped) {
+    checkpointed_file_t *file;
+    checkpoint_entry_t *entry;
+    cookie_io_functions_t functions;
+    struct stat st;
+    char *canonical;
+    FILE *stream;
+    int fd = fileno(infile);
+    *lines_skipped = 0;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+            (canonical = realpath(path, NULL)) == NULL)
+        return infile;
+    entry = find_entry(checkpoint, canonical);
+    file = malloc(sizeof(checkpointed_file_t));
+    file->infile = infile;
+    file->entry = entry;
+    file->offset = 0;
+    file->lines = 0;
+    if (entry->offset != 0 && entry->dev == st.st_dev && entry->ino == st.st_ino &&
+            (off_t)entry->offset <= st.st_size &&
+            fingerprint(fd, entry->offset) == entry->fingerprint) {
+        file->offset = entry->offset;
+        file->lines = entry->lines;
+    }
+    file->end = end_of_last_line(fd, file->offset, st.st_size);
+    memset(&functions, 0, sizeof(functions));
+    functions.read = &read_checkpointed_file;
+    functions.close = &close_checkpointed_file;
+    if ((stream = fopencookie(file, "r", functions)) == NULL) {
+        free(file);
+        return infile;
+    }
+    *lines_skipped = file->lines;
+    return stream;
+}
@@ -0,0 +1,605 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "include/nfa.h"
+#include "include/filepaths.h"
+#include "include/search.h"
+#include "include/compress.h"
+
+
+/* Compressed bytes read at a time, and the buffer size of a decompressed
+ * stream, so that data is decompressed in large blocks rather than as each
+ * symbol is read */
+#define DECOMPRESS_BLOCK    (128 * 1024)
+
+/* Compressed bytes, in whole members or frames, in each part of a file
+ * which is decompressed and searched in parallel with the others */
+#define PARALLEL_CHUNK_BYTES    (256 * 1024)
+
+/* Parts which may be decompressed ahead of the output, per worker */
+#define PARALLEL_WINDOW     2
+
+/* A BGZF block starts with a gzip header carrying its length in an extra
+ * field, so that blocks can be found without decompressing them */
+#define BGZF_HEADER_BYTES   18
+
+
+/* Decompressor for either format, which reads any number of members or
+ * frames one after another */
+typedef struct decoder {
+    compression_t format;
+    int at_boundary;    /* between members or frames, so the input may end */
+    z_stream zstream;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+} decoder_t;
+
+/* State behind a stream returned by open_decompressed() */
+typedef struct decompressed_file {
+    FILE *infile;
+    char *filename;
+    FILE *errfile;
+    decoder_t decoder;
+    unsigned char *in;      /* block of input read from infile */
+    unsigned char *next_in; /* first byte of in not yet used */
+    size_t in_len;          /* bytes of in from next_in on */
+    int failed;
+} decompressed_file_t;
+
+/* Run of whole members or frames which is decompressed and searched by one
+ * worker. The lines of a chunk are those which begin in it, so its last
+ * line may continue into the following chunks, while its first belongs to
+ * the previous chunk, unless it is the first chunk. */
+typedef struct chunk {
+    size_t offset;      /* in the compressed file */
+    size_t len;
+    size_t newlines;    /* in its decompressed data */
+    size_t lines_before;    /* newlines in all the chunks before it */
+    int counted;        /* whether newlines is known yet */
+    int searched;
+    int failed;         /* whether its own data was corrupt or truncated */
+    match_status_t status;
+    char *output;       /* what the search of the chunk printed */
+    size_t output_len;
+} chunk_t;
+
+/* Compressed file being searched by several workers at once, with output
+ * written in the order of the file */
+typedef struct parallel_search {
+    char *filename;
+    unsigned char *data;    /* the mapped file */
+    compression_t format;
+    chunk_t *chunks;
+    size_t chunk_count;
+    size_t next_chunk;      /* next to be taken by a worker */
+    size_t counted;         /* leading chunks whose lines_before are known */
+    size_t lines_counted;   /* newlines in the first counted chunks */
+    size_t written;         /* leading chunks whose output has been written */
+    size_t window;          /* chunks which may be taken beyond those written */
+    nfa_t *nfa;
+    search_opts_t *opts;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} parallel_search_t;
+
+
+/* Returns the format of data beginning with the given bytes */
+compression_t detect_compression(unsigned char *bytes, size_t len) {
+    if (len >= 2 && bytes[0] == 0x1F && bytes[1] == 0x8B)
+        return COMPRESSION_GZIP;
+    /* a zstd frame, or a skippable frame such as a seek table */
+    if (len >= 4 && bytes[1] == 0xB5 && bytes[2] == 0x2F && bytes[3] == 0xFD &&
+            bytes[0] == 0x28)
+        return COMPRESSION_ZSTD;
+    if (len >= 4 && (bytes[0] & 0xF0) == 0x50 && bytes[1] == 0x2A &&
+            bytes[2] == 0x4D && bytes[3] == 0x18)
+        return COMPRESSION_ZSTD;
+    return COMPRESSION_NONE;
+}
+
+
+/* Returns 0 on success, or -1 if the format is not supported */
+int init_decoder(decoder_t *decoder, compression_t format) {
+    decoder->format = format;
+    decoder->at_boundary = 1;
+    switch (format) {
+    case COMPRESSION_GZIP:
+        memset(&decoder->zstream, 0, sizeof(z_stream));
+        /* 16 + MAX_WBITS accepts a gzip header, and no other */
+        return (inflateInit2(&decoder->zstream, 16 + MAX_WBITS) == Z_OK) ? 0 : -1;
+    case COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+        if ((decoder->zstd = ZSTD_createDStream()) == NULL)
+            return -1;
+        return ZSTD_isError(ZSTD_initDStream(decoder->zstd)) ? -1 : 0;
+#else
+        return -1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+
+void end_decoder(decoder_t *decoder) {
+    switch (decoder->format) {
+    case COMPRESSION_GZIP:
+        inflateEnd(&decoder->zstream);
+        break;
+    case COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+        ZSTD_freeDStream(decoder->zstd);
+#endif
+        break;
+    default:
+        break;
+    }
+}
+
+
+/* Decompresses as much of the in_len bytes at *in as fits in the out_len
+ * bytes at *out, and advances both past what was used. Output may still be
+ * pending once all the input is used, so the decoder must be run with no
+ * input until it is at a boundary. Returns 0, or -1 if the data is
+ * corrupt. */
+int run_decoder(decoder_t *decoder, unsigned char **in, size_t *in_len,
+                char **out, size_t *out_len) {
+    size_t consumed, produced;
+    int ret;
+#ifdef HAVE_ZSTD
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    size_t zstd_ret;
+    if (decoder->format == COMPRESSION_ZSTD) {
+        input.src = *in;
+        input.size = *in_len;
+        input.pos = 0;
+        output.dst = *out;
+        output.size = *out_len;
+        output.pos = 0;
+        /* frames following the first are decompressed as they come */
+        zstd_ret = ZSTD_decompressStream(decoder->zstd, &output, &input);
+        *in += input.pos;
+        *in_len -= input.pos;
+        *out += output.pos;
+        *out_len -= output.pos;
+        /* 0 once a frame is fully decoded and flushed */
+        decoder->at_boundary = (zstd_ret == 0);
+        return ZSTD_isError(zstd_ret) ? -1 : 0;
+    }
+#endif
+    decoder->zstream.next_in = *in;
+    decoder->zstream.avail_in = (*in_len > UINT_MAX) ? UINT_MAX : *in_len;
+    decoder->zstream.next_out = (Bytef *)*out;
+    decoder->zstream.avail_out = (*out_len > UINT_MAX) ? UINT_MAX : *out_len;
+    ret = inflate(&decoder->zstream, Z_NO_FLUSH);
+    consumed = decoder->zstream.next_in - *in;
+    produced = (char *)decoder->zstream.next_out - *out;
+    *in += consumed;
+    *in_len -= consumed;
+    *out += produced;
+    *out_len -= produced;
+    if (consumed > 0 || produced > 0)
+        decoder->at_boundary = 0;
+    if (ret == Z_STREAM_END) {
+        /* another member may follow */
+        decoder->at_boundary = 1;
+        ret = inflateReset(&decoder->zstream);
+    }
+    return (ret == Z_OK || ret == Z_BUF_ERROR) ? 0 : -1;
+}
+
+
+ssize_t read_decompressed_file(void *cookie, char *buf, size_t size) {
+    decompressed_file_t *file = (decompressed_file_t *)cookie;
+    char *out = buf;
+    size_t out_len = size, in_before;
+    if (file->decoder.format == COMPRESSION_NONE) {
+        /* pass the input through, starting with the block read to detect it */
+        if (file->in_len > 0) {
+            out_len = (size < file->in_len) ? size : file->in_len;
+            memcpy(buf, file->next_in, out_len);
+            file->next_in += out_len;
+            file->in_len -= out_len;
+            return out_len;
+        }
+        out_len = fread(buf, 1, size, file->infile);
+        return (out_len == 0 && ferror(file->infile)) ? -1 : (ssize_t)out_len;
+    }
+    while (out_len == size && !file->failed) {
+        if (file->in_len == 0) {
+            file->next_in = file->in;
+            file->in_len = fread(file->in, 1, DECOMPRESS_BLOCK, file->infile);
+            if (file->in_len == 0 && file->decoder.at_boundary)
+                break;  /* end of the input, after a whole member or frame */
+        }
+        in_before = file->in_len;
+        if (run_decoder(&file->decoder, &file->next_in, &file->in_len, &out, &out_len) != 0) {
+            fprintf(file->errfile, "ERROR: corrupt compressed data in file: %s\n", file->filename);
+            file->failed = 1;
+        } else if (out_len == size && file->in_len == in_before) {
+            /* the input ended within a member or frame */
+            fprintf(file->errfile, "ERROR: truncated compressed data in file: %s\n",
+                    file->filename);
+            file->failed = 1;
+        }
+    }
+    if (file->failed && out_len == size)
+        return -1;  /* so that ferror() tells the search the data was bad */
+    return size - out_len;
+}
+
+
+int close_decompressed_file(void *cookie) {
+    decompressed_file_t *file = (decompressed_file_t *)cookie;
+    end_decoder(&file->decoder);
+    fclose(file->infile);
+    free(file->in);
+    free(file);
+    return 0;
+}
+
+
+/* Returns a stream of the decompressed contents of infile, detecting the
+ * format from its first bytes. Input which is not compressed is passed
+ * through as is. Closing the stream closes infile. Returns NULL, having
+ * closed infile, if the format is not supported. filename is only used in
+ * messages, and must remain valid until the stream is closed. */
+FILE *open_decompressed(FILE *infile, char *filename, FILE *errfile) {
+    decompressed_file_t *file = malloc(sizeof(decompressed_file_t));
+    cookie_io_functions_t functions;
+    compression_t format;
+    FILE *stream;
+    file->infile = infile;
+    file->filename = filename;
+    file->errfile = errfile;
+    file->in = malloc(DECOMPRESS_BLOCK);
+    file->next_in = file->in;
+    file->in_len = fread(file->in, 1, DECOMPRESS_BLOCK, infile);
+    file->failed = 0;
+    format = detect_compression(file->in, file->in_len);
+    if (init_decoder(&file->decoder, format) != 0) {
+#ifndef HAVE_ZSTD
+        if (format == COMPRESSION_ZSTD)
+            fprintf(errfile, "ERROR: zstd support not built in, skipping file: %s\n", filename);
+        else
+#endif
+        fprintf(errfile, "ERROR: could not decompress file: %s\n", filename);
+        goto OPEN_FAILED;
+    }
+    memset(&functions, 0, sizeof(functions));
+    functions.read = &read_decompressed_file;
+    functions.close = &close_decompressed_file;
+    if ((stream = fopencookie(file, "r", functions)) == NULL) {
+        end_decoder(&file->decoder);
+        goto OPEN_FAILED;
+    }
+    setvbuf(stream, NULL, _IOFBF, DECOMPRESS_BLOCK);
+    return stream;
+OPEN_FAILED:
+    fclose(infile);
+    free(file->in);
+    free(file);
+    return NULL;
+}
+
+
+/* Returns the length of the BGZF block at data, or 0 if it is not one */
+size_t bgzf_block_len(unsigned char *data, size_t len) {
+    size_t extra_len, pos, field_len;
+    if (len < BGZF_HEADER_BYTES || data[0] != 0x1F || data[1] != 0x8B ||
+            data[2] != 8 || !(data[3] & 4))
+        return 0;
+    extra_len = data[10] | (data[11] << 8);
+    for (pos = 12; pos + 4 <= 12 + extra_len && pos + 4 <= len; pos += 4 + field_len) {
+        field_len = data[pos + 2] | (data[pos + 3] << 8);
+        if (data[pos] == 'B' && data[pos + 1] == 'C' && field_len == 2 && pos + 6 <= len)
+            return (data[pos + 4] | (data[pos + 5] << 8)) + 1;
+    }
+    return 0;
+}
+
+
+/* Returns the length of the member or frame at data, if it can be found
+ * without decompressing it, or 0 */
+size_t member_len(compression_t format, unsigned char *data, size_t len) {
+    size_t frame_len;
+    if (format == COMPRESSION_GZIP) {
+        /* only BGZF records the lengths of gzip members */
+        frame_len = bgzf_block_len(data, len);
+        return (frame_len <= len) ? frame_len : 0;
+    }
+#ifdef HAVE_ZSTD
+    frame_len = ZSTD_findFrameCompressedSize(data, len);
+    return ZSTD_isError(frame_len) ? 0 : frame_len;
+#else
+    return 0;
+#endif
+}
+
+
+/* Divides the size bytes of the mapped file into chunks of whole members
+ * or frames. Returns the number of chunks, or 0 if the members or frames
+ * cannot all be found without decompressing them. */
+size_t find_chunks(parallel_search_t *search, size_t size) {
+    size_t offset = 0, len, capacity = 0;
+    chunk_t *chunk = NULL;
+    search->chunks = NULL;
+    search->chunk_count = 0;
+    while (offset < size) {
+        if ((len = member_len(search->format, search->data + offset, size - offset)) == 0) {
+            free(search->chunks);
+            search->chunks = NULL;
+            search->chunk_count = 0;
+            return 0;
+        }
+        if (chunk == NULL || chunk->len >= PARALLEL_CHUNK_BYTES) {
+            if (search->chunk_count == capacity) {
+                capacity = (capacity == 0) ? 64 : capacity * 2;
+                search->chunks = realloc(search->chunks, sizeof(chunk_t) * capacity);
+            }
+            chunk = &search->chunks[search->chunk_count++];
+            memset(chunk, 0, sizeof(chunk_t));
+            chunk->offset = offset;
+        }
+        chunk->len += len;
+        offset += len;
+    }
+    return search->chunk_count;
+}
+
+
+/* Decompresses the chunk, appending to the *len bytes in *buf, a block of
+ * *size bytes which is grown as needed. If stop_at_newline, stops after
+ * the first newline decompressed, and returns 1. Otherwise returns 0 once
+ * the whole chunk has been decompressed, or -1 if it is corrupt or ends
+ * within a member or frame. */
+int decompress_chunk(parallel_search_t *search, chunk_t *chunk, char **buf,
+                     size_t *len, size_t *size, int stop_at_newline) {
+    decoder_t decoder;
+    unsigned char *in = search->data + chunk->offset;
+    size_t in_len = chunk->len, out_len, in_before;
+    char *out, *newline;
+    int status = 0;
+    if (init_decoder(&decoder, search->format) != 0)
+        return -1;
+    while (in_len > 0 || !decoder.at_boundary) {
+        if (*size - *len < DECOMPRESS_BLOCK) {
+            *size = *size * 2 + DECOMPRESS_BLOCK;
+            *buf = realloc(*buf, *size);
+        }
+        out = *buf + *len;
+        out_len = *size - *len;
+        in_before = in_len;
+        if (run_decoder(&decoder, &in, &in_len, &out, &out_len) != 0 ||
+                (out == *buf + *len && in_len == in_before)) {
+            status = -1;
+            break;
+        }
+        if (stop_at_newline &&
+                (newline = memchr(*buf + *len, '\n', out - (*buf + *len))) != NULL) {
+            *len = newline + 1 - *buf;
+            status = 1;
+            break;
+        }
+        *len = out - *buf;
+    }
+    end_decoder(&decoder);
+    return status;
+}
+
+
+size_t count_newlines(char *buf, size_t len) {
+    size_t newlines = 0;
+    char *end = buf + len;
+    while ((buf = memchr(buf, '\n', end - buf)) != NULL) {
+        newlines++;
+        buf++;
+    }
+    return newlines;
+}
+
+
+/* Records the number of newlines in chunk i, and waits until the number
+ * in all the chunks before it is known, which it returns */
+size_t count_chunk_lines(parallel_search_t *search, size_t i, size_t newlines) {
+    size_t lines_before;
+    pthread_mutex_lock(&search->lock);
+    search->chunks[i].newlines = newlines;
+    search->chunks[i].counted = 1;
+    while (search->counted < search->chunk_count &&
+            search->chunks[search->counted].counted) {
+        search->chunks[search->counted].lines_before = search->lines_counted;
+        search->lines_counted += search->chunks[search->counted].newlines;
+        search->counted++;
+    }
+    pthread_cond_broadcast(&search->changed);
+    /* chunks are taken in order, and counted without waiting, so this ends */
+    while (search->counted <= i)
+        pthread_cond_wait(&search->changed, &search->lock);
+    lines_before = search->chunks[i].lines_before;
+    pthread_mutex_unlock(&search->lock);
+    return lines_before;
+}
+
+
+/* Searches the lines of chunk i, with its output kept in the chunk */
+void search_chunk(parallel_search_t *search, size_t i) {
+    chunk_t *chunk = &search->chunks[i];
+    search_opts_t chunk_opts = *search->opts;
+    char *buf = NULL, *start;
+    size_t len = 0, size = 0, own_len, lines_before, j;
+    FILE *infile;
+    int status;
+    /* errors in the following chunks are reported by their own workers */
+    if ((status = decompress_chunk(search, chunk, &buf, &len, &size, 0)) < 0) {
+        fprintf(search->opts->errfile, "ERROR: corrupt compressed data in file: %s\n",
+                search->filename);
+        chunk->failed = 1;
+    }
+    own_len = len;
+    lines_before = count_chunk_lines(search, i, count_newlines(buf, len));
+    /* the last line may continue into the following chunks */
+    for (j = i + 1; status == 0 && j < search->chunk_count; j++)
+        status = decompress_chunk(search, &search->chunks[j], &buf, &len, &size, 1);
+    start = buf;
+    chunk_opts.lines_skipped += lines_before;
+    if (i > 0) {
+        /* the first line belongs to the previous chunk */
+        if ((start = memchr(buf, '\n', own_len)) == NULL)
+            start = buf + len;
+        else
+            start++;
+        chunk_opts.lines_skipped++;
+    }
+    if (start < buf + len && (infile = fmemopen(start, buf + len - start, "r")) != NULL) {
+        chunk_opts.outfile = open_memstream(&chunk->output, &chunk->output_len);
+        if (chunk_opts.outfile != NULL) {
+            chunk->status = search_file(search->filename, infile, search->nfa, &chunk_opts);
+            fclose(chunk_opts.outfile);
+        }
+        fclose(infile);
+    }
+    free(buf);
+}
+
+
+void *run_parallel_search(void *arg) {
+    parallel_search_t *search = (parallel_search_t *)arg;
+    size_t i;
+    while (1) {
+        pthread_mutex_lock(&search->lock);
+        while (search->next_chunk < search->chunk_count &&
+                search->next_chunk >= search->written + search->window)
+            pthread_cond_wait(&search->changed, &search->lock);
+        if (search->next_chunk == search->chunk_count) {
+            pthread_mutex_unlock(&search->lock);
+            return NULL;
+        }
+        i = search->next_chunk++;
+        pthread_mutex_unlock(&search->lock);
+        search_chunk(search, i);
+        pthread_mutex_lock(&search->lock);
+        search->chunks[i].searched = 1;
+        pthread_cond_broadcast(&search->changed);
+        pthread_mutex_unlock(&search->lock);
+    }
+}
+
+
+/* Searches the mapped file with a worker per processor, each decompressing
+ * and searching a chunk at a time, while this thread writes the output of
+ * each chunk in order. Returns -1 if the file cannot be searched this way,
+ * so that it should be decompressed serially instead. */
+int search_in_parallel(parallel_search_t *search, size_t size) {
+    pthread_t *workers;
+    long worker_count = sysconf(_SC_NPROCESSORS_ONLN), started;
+    match_status_t status = MATCH_NONE;
+    size_t i;
+    if (worker_count < 2)
+        return -1;
+    if (find_chunks(search, size) < 2) {
+        free(search->chunks);
+        return -1;
+    }
+    if ((size_t)worker_count > search->chunk_count)
+        worker_count = search->chunk_count;
+    search->next_chunk = 0;
+    search->counted = 0;
+    search->lines_counted = 0;
+    search->written = 0;
+    search->window = worker_count * PARALLEL_WINDOW;
+    pthread_mutex_init(&search->lock, NULL);
+    pthread_cond_init(&search->changed, NULL);
+    workers = malloc(sizeof(pthread_t) * worker_count);
+    for (started = 0; started < worker_count; started++) {
+        if (pthread_create(&workers[started], NULL, &run_parallel_search, search) != 0)
+            break;
+    }
+    if (started == 0) {
+        free(workers);
+        free(search->chunks);
+        pthread_mutex_destroy(&search->lock);
+        pthread_cond_destroy(&search->changed);
+        return -1;
+    }
+    for (i = 0; i < search->chunk_count; i++) {
+        pthread_mutex_lock(&search->lock);
+        while (!search->chunks[i].searched)
+            pthread_cond_wait(&search->changed, &search->lock);
+        pthread_mutex_unlock(&search->lock);
+        if (search->chunks[i].output != NULL) {
+            fwrite(search->chunks[i].output, 1, search->chunks[i].output_len,
+                   search->opts->outfile);
+            free(search->chunks[i].output);
+        }
+        if (search->chunks[i].status == MATCH_FOUND)
+            status = MATCH_FOUND;
+        if (search->chunks[i].failed)
+            search->opts->failed = 1;
+        pthread_mutex_lock(&search->lock);
+        search->written++;
+        pthread_cond_broadcast(&search->changed);
+        pthread_mutex_unlock(&search->lock);
+    }
+    while (started > 0)
+        pthread_join(workers[--started], NULL);
+    free(workers);
+    free(search->chunks);
+    pthread_mutex_destroy(&search->lock);
+    pthread_cond_destroy(&search->changed);
+    return status;
+}
+
+
+/* Searches the decompressed contents of infile, which is closed. A regular
+ * file made of members or frames which can be found without decompressing
+ * them, such as BGZF or seekable zstd, is searched in parallel, unless
+ * context lines are printed, since they may cross between the parts
+ * searched. Anything else is decompressed as a stream. If the file cannot
+ * be decompressed, or only in part, opts->failed is set. */
+match_status_t search_compressed_file(char *filename, FILE *infile, nfa_t *nfa,
+                                      search_opts_t *opts) {
+    parallel_search_t search;
+    match_status_t status;
+    struct stat st;
+    int parallel_status = -1;
+    if (opts->before_context == 0 && opts->after_context == 0 &&
+            fstat(fileno(infile), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (search.data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                fileno(infile), 0)) != MAP_FAILED) {
+        search.filename = filename;
+        search.format = detect_compression(search.data, st.st_size);
+        search.nfa = nfa;
+        search.opts = opts;
+        if (search.format != COMPRESSION_NONE)
+            parallel_status = search_in_parallel(&search, st.st_size);
+        munmap(search.data, st.st_size);
+    }
+    if (parallel_status >= 0) {
+        fclose(infile);
+        return parallel_status;
+    }
+    if ((infile = open_decompressed(infile, filename, opts->errfile)) == NULL) {
+        opts->failed = 1;
+        return MATCH_NONE;
+    }
+    status = search_file(filename, infile, nfa, opts);
+    if (ferror(infile))
+        opts->failed = 1;
+    fclose(infile);
+    return status;
+}
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "include/nfa.h"
+#include "include/filepaths.h"
+#include "include/search.h"
+#include "include/count.h"
+#include "include/compress.h"
+
+
+#define COUNT_BUFSIZE   512
+
+#define ERR_EOF     0
+
+
+/* One worker's counts for each pattern, merged with the others' once every
+ * file has been searched, so that workers never contend over a counter */
+typedef struct pattern_counts {
+    unsigned long *counts;      /* lines matching each pattern */
+    size_t *first_files;        /* index of the file of each pattern's first match */
+    unsigned long *first_lines; /* line number of each pattern's first match */
+    pattern_hits_t hits;
+    int failed;                 /* whether some file could not be read in full */
+} pattern_counts_t;
+
+/* Files shared among the workers, each taking the next one in turn */
+typedef struct count_job {
+    nfa_t *nfa;
+    int pattern_count;
+    char **paths;
+    size_t path_count;
+    size_t next_path;
+    search_opts_t *opts;
+} count_job_t;
+
+typedef struct count_worker {
+    pthread_t thread;
+    count_job_t *job;
+    pattern_counts_t counts;
+} count_worker_t;
+
+
+/* Reads the patterns in filename, one per line, skipping empty lines.
+ * Returns NULL if the file could not be read or holds no patterns. */
+char **load_patterns(char *filename, int *pattern_count) {
+    FILE *infile;
+    char **patterns = NULL, *line = NULL;
+    size_t linesize = 0, capacity = 0;
+    ssize_t len;
+    *pattern_count = 0;
+    if ((infile = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "ERROR: could not open file: %s\n", filename);
+        return NULL;
+    }
+    while ((len = getline(&line, &linesize, infile)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if ((size_t)*pattern_count == capacity) {
+            capacity = (capacity == 0) ? 16 : capacity * 2;
+            patterns = realloc(patterns, sizeof(char *) * capacity);
+        }
+        patterns[*pattern_count] = malloc(len + 1);
+        strcpy(patterns[*pattern_count], line);
+        (*pattern_count)++;
+    }
+    free(line);
+    fclose(infile);
+    if (*pattern_count == 0) {
+        fprintf(stderr, "ERROR: no patterns in file: %s\n", filename);
+        free(patterns);
+        return NULL;
+    }
+    return patterns;
+}
+
+
+void init_pattern_counts(pattern_counts_t *counts, int pattern_count) {
+    counts->counts = calloc(pattern_count, sizeof(unsigned long));
+    counts->first_files = calloc(pattern_count, sizeof(size_t));
+    counts->first_lines = calloc(pattern_count, sizeof(unsigned long));
+    counts->hits.stamp = 0;
+    counts->hits.stamps = calloc(pattern_count, sizeof(unsigned long));
+    counts->hits.hits = malloc(sizeof(int) * pattern_count);
+    counts->hits.hit_count = 0;
+    counts->failed = 0;
+}
+
+
+void free_pattern_counts(pattern_counts_t *counts) {
+    free(counts->counts);
+    free(counts->first_files);
+    free(counts->first_lines);
+    free(counts->hits.stamps);
+    free(counts->hits.hits);
+}
+
+
+/* Adds the counts of each pattern in src to those in dest, keeping the
+ * earlier of the two first matches */
+void merge_pattern_counts(pattern_counts_t *dest, pattern_counts_t *src, int pattern_count) {
+    int i;
+    dest->failed |= src->failed;
+    for (i = 0; i < pattern_count; i++) {
+        if (src->counts[i] == 0)
+            continue;
+        if (dest->counts[i] == 0 || src->first_files[i] < dest->first_files[i] ||
+                (src->first_files[i] == dest->first_files[i] &&
+                 src->first_lines[i] < dest->first_lines[i])) {
+            dest->first_files[i] = src->first_files[i];
+            dest->first_lines[i] = src->first_lines[i];
+        }
+        dest->counts[i] += src->counts[i];
+    }
+}
+
+
+/* Counts the lines of infile matching each pattern. Every line is read as
+ * text, so that one binary line does not end the count, but unless -a was
+ * given, a line holding a '\0' is skipped rather than counted, and the
+ * number skipped is reported on errfile. */
+void count_file(count_job_t *job, pattern_counts_t *counts, size_t file_index,
+                char *filename, FILE *infile) {
+    size_t bufsize = COUNT_BUFSIZE, bytes_read;
+    char *buf = malloc(sizeof(char) * bufsize);
+    unsigned long line_number = 0, lines_skipped = 0;
+    int i, id, binary = 0;
+    while ((bytes_read = fill_buffer(infile, &buf, &bufsize, &binary,
+                                     job->opts->flags | ARG_FLAG_A)) != ERR_EOF) {
+        line_number++;
+        if (!(job->opts->flags & ARG_FLAG_A) && strlen(buf) + 1 < bytes_read) {
+            lines_skipped++;
+            continue;
+        }
+        counts->hits.stamp++;
+        counts->hits.hit_count = 0;
+        find_patterns(buf, bufsize, job->nfa, &counts->hits, job->opts->flags & ARG_FLAG_I);
+        for (i = 0; i < counts->hits.hit_count; i++) {
+            id = counts->hits.hits[i];
+            if (counts->counts[id]++ == 0) {
+                counts->first_files[id] = file_index;
+                counts->first_lines[id] = line_number;
+            }
+        }
+    }
+    if (ferror(infile))
+        counts->failed = 1;
+    if (lines_skipped != 0)
+        fprintf(job->opts->errfile, "Binary file %s: skipped %lu lines holding a '\\0'\n",
+                filename, lines_skipped);
+    free(buf);
+}
+
+
+void *run_count_worker(void *arg) {
+    count_worker_t *worker = (count_worker_t *)arg;
+    count_job_t *job = worker->job;
+    FILE *infile;
+    size_t i;
+    while ((i = __sync_fetch_and_add(&job->next_path, 1)) < job->path_count) {
+        if ((infile = fopen(job->paths[i], "r")) == NULL) {
+            fprintf(job->opts->errfile, "ERROR: could not open file: %s\n", job->paths[i]);
+            worker->counts.failed = 1;
+            continue;
+        }
+        if ((job->opts->flags & ARG_FLAG_Z) &&
+                (infile = open_decompressed(infile, job->paths[i], job->opts->errfile)) == NULL) {
+            worker->counts.failed = 1;
+            continue;
+        }
+        count_file(job, &worker->counts, i, job->paths[i], infile);
+        fclose(infile);
+    }
+    return NULL;
+}
+
+
+/* Appends the paths in filepaths to the array of paths */
+void append_paths(count_job_t *job, size_t *capacity, struct filepath_node *filepaths) {
+    for (; filepaths != NULL; filepaths = filepaths->next) {
+        if (job->path_count == *capacity) {
+            *capacity = (*capacity == 0) ? 64 : *capacity * 2;
+            job->paths = realloc(job->paths, sizeof(char *) * (*capacity));
+        }
+        job->paths[job->path_count++] = filepaths->path;
+    }
+}
+
+
+/* Counts the lines matching each of the patterns in pattern_file, over all
+ * of the given files (or stdin if there are none, and -r was not given) in
+ * a single pass, and prints each pattern's count, preceded with -n by the
+ * location of its first match. Files are shared among one worker per
+ * processor, each with its own counts. Returns the status of the search,
+ * or -1 if the patterns could not be loaded. */
+int count_by_pattern(char *pattern_file, char **paths, int path_count, search_opts_t *opts) {
+    char **patterns;
+    char *dot = ".";
+    struct filepath_node **lists;
+    count_job_t job;
+    count_worker_t *workers;
+    pattern_counts_t totals;
+    FILE *infile;
+    size_t capacity = 0;
+    long worker_count;
+    int i, list_count, started, status = MATCH_NONE;
+    if ((patterns = load_patterns(pattern_file, &job.pattern_count)) == NULL)
+        return -1;
+    if ((job.nfa = build_union_nfa(patterns, job.pattern_count, opts->flags & ARG_FLAG_I,
+                                   opts->flags & ARG_FLAG_UTF8)) == NULL) {
+        for (i = 0; i < job.pattern_count; i++)
+            free(patterns[i]);
+        free(patterns);
+        return -1;
+    }
+    job.paths = NULL;
+    job.path_count = 0;
+    job.next_path = 0;
+    job.opts = opts;
+    if ((opts->flags & ARG_FLAG_R) && path_count == 0) {
+        paths = &dot;
+        path_count = 1;
+    }
+    list_count = path_count;
+    lists = malloc(sizeof(struct filepath_node *) * (list_count + 1));
+    for (i = 0; i < list_count; i++) {
+        if (opts->flags & ARG_FLAG_R)
+            lists[i] = build_recursive_filepaths_list(paths[i], opts->filter, opts->errfile);
+        else
+            lists[i] = build_filepaths_list(paths + i, 1);
+        append_paths(&job, &capacity, lists[i]);
+    }
+    init_pattern_counts(&totals, job.pattern_count);
+    if (path_count == 0 && (opts->flags & ARG_FLAG_Z)) {
+        if ((infile = open_decompressed(stdin, "stdin", opts->errfile)) != NULL) {
+            count_file(&job, &totals, 0, "stdin", infile);
+            fclose(infile);
+        } else {
+            totals.failed = 1;
+        }
+    } else if (path_count == 0) {
+        count_file(&job, &totals, 0, "stdin", stdin);
+    } else {
+        worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+        if ((size_t)worker_count > job.path_count)
+            worker_count = job.path_count;
+        if (worker_count < 1)
+            worker_count = 1;
+        workers = malloc(sizeof(count_worker_t) * worker_count);
+        for (started = 0; started < worker_count; started++) {
+            workers[started].job = &job;
+            init_pattern_counts(&workers[started].counts, job.pattern_count);
+            if (pthread_create(&workers[started].thread, NULL, &run_count_worker,
+                               &workers[started]) != 0) {
+                free_pattern_counts(&workers[started].counts);
+                break;
+            }
+        }
+        if (started == 0) {
+            /* no threads could be started, so count the files here */
+            workers[0].job = &job;
+            workers[0].counts = totals;
+            run_count_worker(&workers[0]);
+            totals.failed = workers[0].counts.failed;
+        }
+        for (i = 0; i < started; i++) {
+            pthread_join(workers[i].thread, NULL);
+            merge_pattern_counts(&totals, &workers[i].counts, job.pattern_count);
+            free_pattern_counts(&workers[i].counts);
+        }
+        free(workers);
+    }
+    for (i = 0; i < job.pattern_count; i++) {
+        fprintf(opts->outfile, "%lu\t", totals.counts[i]);
+        if ((opts->flags & ARG_FLAG_N) && totals.counts[i] == 0)
+            fprintf(opts->outfile, "-\t");
+        else if (opts->flags & ARG_FLAG_N)
+            fprintf(opts->outfile, "%s:%lu\t", (path_count == 0) ? "stdin" :
+                    job.paths[totals.first_files[i]], totals.first_lines[i]);
+        fprintf(opts->outfile, "%s\n", patterns[i]);
+        if (totals.counts[i] != 0)
+            status = MATCH_FOUND;
+        free(patterns[i]);
+    }
+    free(patterns);
+    if (totals.failed)
+        opts->failed = 1;
+    free_pattern_counts(&totals);
+    for (i = 0; i < list_count; i++)
+        cleanup_filepaths(lists[i]);
+    free(lists);
+    free(job.paths);
+    free_nfa(job.nfa);
+    return status;
+}
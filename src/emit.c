@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "include/nfa.h"
+#include "include/cache.h"
+#include "include/emit.h"
+
+
+/* Emitting gives up on expressions whose dfa has more states than this */
+#define EMIT_MAX_STATES     4096
+
+#define DFA_HASH_BUCKETS    (2 * EMIT_MAX_STATES)
+
+#define NO_DFA_STATE        (-1)
+#define TOO_MANY_STATES     (-2)
+
+
+/* A thread of the nfa is fully described by its state and its repetition
+ * counters, so a configuration is the state id followed by the value of
+ * each counter. A dfa state is the set of configurations of all threads
+ * which may be running at a position once every epsilon and counter
+ * transition has been followed, sorted so that equal sets are identical.
+ * Counters are bounded by their repeat counts, so counted repetitions are
+ * unrolled into the dfa rather than refused. */
+typedef struct dfa_state {
+    unsigned int *configs;
+    size_t config_count;
+    int accepting;      /* some thread has reached qaccept */
+    int progressing;    /* some thread has not reached qaccept */
+    int next[256];      /* dfa state after reading each byte, or NO_DFA_STATE */
+    int hash_next;      /* next dfa state in the same hash bucket */
+    uint64_t hash;
+} dfa_state_t;
+
+typedef struct dfa_builder {
+    state_t **states;   /* nfa states indexed by id */
+    int qaccept_id;
+    size_t width;       /* unsigned ints in each configuration */
+    dfa_state_t *dfa_states;
+    int dfa_state_count;
+    int buckets[DFA_HASH_BUCKETS];
+    unsigned int *set;  /* sorted configurations of the set being built */
+    size_t set_count;
+    size_t set_capacity;
+} dfa_builder_t;
+
+
+void index_states(state_t **states, state_t *state) {
+    transition_t *cur_t;
+    if (states[state->id] != NULL)
+        return;
+    states[state->id] = state;
+    for (cur_t = state->transitions; cur_t != NULL; cur_t = cur_t->next)
+        index_states(states, cur_t->next_state);
+}
+
+
+int compare_configs(unsigned int *a, unsigned int *b, size_t width) {
+    size_t i;
+    for (i = 0; i < width; i++) {
+        if (a[i] != b[i])
+            return (a[i] < b[i]) ? -1 : 1;
+    }
+    return 0;
+}
+
+
+/* Inserts config into the set being built, keeping it sorted. Returns 0 if
+ * it was already present, or 1 if it was added. */
+int add_config(dfa_builder_t *builder, unsigned int *config) {
+    size_t lo = 0, hi = builder->set_count, mid;
+    unsigned int *slot;
+    int cmp;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmp = compare_configs(builder->set + mid * builder->width, config, builder->width);
+        if (cmp == 0)
+            return 0;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (builder->set_count == builder->set_capacity) {
+        builder->set_capacity = builder->set_capacity * 2 + 16;
+        builder->set = realloc(builder->set, sizeof(unsigned int) *
+                               builder->width * builder->set_capacity);
+    }
+    slot = builder->set + lo * builder->width;
+    memmove(slot + builder->width, slot,
+            sizeof(unsigned int) * builder->width * (builder->set_count - lo));
+    memcpy(slot, config, sizeof(unsigned int) * builder->width);
+    builder->set_count++;
+    return 1;
+}
+
+
+/* Adds config to the set being built, along with every configuration which
+ * it reaches without reading a symbol */
+void close_config(dfa_builder_t *builder, unsigned int *config) {
+    transition_t *cur_t;
+    unsigned int *next_config;
+    if (!add_config(builder, config) || (int)config[0] == builder->qaccept_id)
+        return;
+    next_config = malloc(sizeof(unsigned int) * builder->width);
+    for (cur_t = builder->states[config[0]]->transitions; cur_t != NULL; cur_t = cur_t->next) {
+        if (!IS_EPSILON(cur_t->flags) || !transition_viable(cur_t, '\0', config + 1))
+            continue;
+        memcpy(next_config, config, sizeof(unsigned int) * builder->width);
+        next_config[0] = cur_t->next_state->id;
+        apply_counters(cur_t, next_config + 1);
+        close_config(builder, next_config);
+    }
+    free(next_config);
+}
+
+
+/* Returns the dfa state for the set just built, creating it if it is new.
+ * Returns NO_DFA_STATE if the set is empty, or TOO_MANY_STATES if a new dfa
+ * state is needed but there is no room for it. */
+int intern_set(dfa_builder_t *builder) {
+    size_t i, size = sizeof(unsigned int) * builder->width * builder->set_count;
+    uint64_t hash = FNV_OFFSET_BASIS;
+    dfa_state_t *dfa_state;
+    int id;
+    if (builder->set_count == 0)
+        return NO_DFA_STATE;
+    hash = fnv1a(hash, builder->set, size);
+    for (id = builder->buckets[hash % DFA_HASH_BUCKETS]; id != NO_DFA_STATE;
+            id = builder->dfa_states[id].hash_next) {
+        dfa_state = &builder->dfa_states[id];
+        if (dfa_state->hash == hash && dfa_state->config_count == builder->set_count &&
+                memcmp(dfa_state->configs, builder->set, size) == 0)
+            return id;
+    }
+    if (builder->dfa_state_count == EMIT_MAX_STATES)
+        return TOO_MANY_STATES;
+    id = builder->dfa_state_count++;
+    dfa_state = &builder->dfa_states[id];
+    dfa_state->configs = malloc(size);
+    memcpy(dfa_state->configs, builder->set, size);
+    dfa_state->config_count = builder->set_count;
+    dfa_state->accepting = 0;
+    dfa_state->progressing = 0;
+    for (i = 0; i < builder->set_count; i++) {
+        if ((int)builder->set[i * builder->width] == builder->qaccept_id)
+            dfa_state->accepting = 1;
+        else
+            dfa_state->progressing = 1;
+    }
+    for (i = 0; i < 256; i++)
+        dfa_state->next[i] = NO_DFA_STATE;
+    dfa_state->hash = hash;
+    dfa_state->hash_next = builder->buckets[hash % DFA_HASH_BUCKETS];
+    builder->buckets[hash % DFA_HASH_BUCKETS] = id;
+    return id;
+}
+
+
+char fold_symbol(int symbol, int case_insensitive) {
+    if (case_insensitive && symbol >= 0x41 && symbol <= 0x5A)
+        return symbol | 0x20;
+    return symbol;
+}
+
+
+/* Builds the dfa of the nfa by subset construction, following every byte
+ * from every dfa state reachable from q0. Returns 0 on success, or -1 if
+ * the dfa would have more than EMIT_MAX_STATES states. */
+int build_dfa(dfa_builder_t *builder, nfa_t *nfa, int case_insensitive) {
+    dfa_state_t *dfa_state;
+    transition_t *cur_t;
+    unsigned int *config, *next_config;
+    size_t i;
+    int id, symbol, next;
+    next_config = calloc(builder->width, sizeof(unsigned int));
+    next_config[0] = nfa->q0->id;
+    builder->set_count = 0;
+    close_config(builder, next_config);
+    intern_set(builder);
+    for (id = 0; id < builder->dfa_state_count; id++) {
+        dfa_state = &builder->dfa_states[id];
+        /* '\0' ends the buffer, so is never read */
+        for (symbol = 1; symbol < 256; symbol++) {
+            builder->set_count = 0;
+            for (i = 0; i < dfa_state->config_count; i++) {
+                config = dfa_state->configs + i * builder->width;
+                if ((int)config[0] == builder->qaccept_id)
+                    continue;
+                for (cur_t = builder->states[config[0]]->transitions; cur_t != NULL;
+                        cur_t = cur_t->next) {
+                    if (IS_EPSILON(cur_t->flags) ||
+                            !transition_viable(cur_t, fold_symbol(symbol, case_insensitive), config + 1))
+                        continue;
+                    memcpy(next_config, config, sizeof(unsigned int) * builder->width);
+                    next_config[0] = cur_t->next_state->id;
+                    close_config(builder, next_config);
+                }
+            }
+            next = intern_set(builder);
+            if (next == TOO_MANY_STATES) {
+                free(next_config);
+                return -1;
+            }
+            dfa_state->next[symbol] = next;
+        }
+    }
+    free(next_config);
+    return 0;
+}
+
+
+/* Writes the expression into a comment, without letting it end the comment */
+void emit_expression_comment(FILE *outfile, char *expression) {
+    char *c;
+    fprintf(outfile, "/* Generated by perg --emit-c from the expression:\n *\n *     ");
+    for (c = expression; *c != '\0'; c++) {
+        if (*c == '\n')
+            fputs("\n *     ", outfile);
+        else if (*c == '*' && c[1] == '/')
+            fputs("* ", outfile);
+        else
+            fputc(*c, outfile);
+    }
+    fprintf(outfile, "\n *\n");
+}
+
+
+/* Writes the case labels of every byte leading to dfa state target, merging
+ * runs of consecutive bytes into case ranges */
+void emit_cases(FILE *outfile, dfa_state_t *dfa_state, int target) {
+    int symbol = 1, end;
+    while (symbol < 256) {
+        if (dfa_state->next[symbol] != target) {
+            symbol++;
+            continue;
+        }
+        for (end = symbol; end + 1 < 256 && dfa_state->next[end + 1] == target; end++)
+            ;
+        if (end == symbol)
+            fprintf(outfile, "    case 0x%02x:\n", symbol);
+        else
+            fprintf(outfile, "    case 0x%02x ... 0x%02x:\n", symbol, end);
+        symbol = end + 1;
+    }
+}
+
+
+void emit_dfa_state(FILE *outfile, dfa_builder_t *builder, int id, int labelled) {
+    dfa_state_t *dfa_state = &builder->dfa_states[id];
+    unsigned char emitted[EMIT_MAX_STATES / 8];
+    int symbol, target, has_next = 0;
+    if (labelled)
+        fprintf(outfile, "S%d:\n", id);
+    if (dfa_state->accepting) {
+        fprintf(outfile, "    *end = pos;\n");
+        fprintf(outfile, "    status = MATCH_FOUND;\n");
+    }
+    if (dfa_state->progressing) {
+        fprintf(outfile, "    if (pos == last)\n");
+        fprintf(outfile, "        return MATCH_PROGRESS;\n");
+    }
+    for (symbol = 1; symbol < 256; symbol++)
+        has_next |= (dfa_state->next[symbol] != NO_DFA_STATE);
+    if (!has_next) {
+        fprintf(outfile, "    return status;\n");
+        return;
+    }
+    memset(emitted, 0, sizeof(emitted));
+    fprintf(outfile, "    switch ((unsigned char)buf[pos++]) {\n");
+    for (symbol = 1; symbol < 256; symbol++) {
+        target = dfa_state->next[symbol];
+        if (target == NO_DFA_STATE || (emitted[target >> 3] & (1 << (target & 7))))
+            continue;
+        emitted[target >> 3] |= 1 << (target & 7);
+        emit_cases(outfile, dfa_state, target);
+        fprintf(outfile, "        goto S%d;\n", target);
+    }
+    fprintf(outfile, "    default:\n");
+    fprintf(outfile, "        return status;\n");
+    fprintf(outfile, "    }\n");
+}
+
+
+/* The generated search_buffer() follows the one in nfa.c, except that each
+ * start position is run through the dfa instead of forking threads, and a
+ * start position inside the previous match is skipped, since a match
+ * starting there would never be printed. */
+static char *search_buffer_source[] = {
+    "match_status_t search_buffer(char *buf, size_t bufsize, nfa_t *nfa,",
+    "                             match_list_t *match_list,  int case_insensitive,",
+    "                             int match_full_words,      int match_full_lines,",
+    "                             int invert_match) {",
+    "    size_t pos, end;",
+    "    match_status_t status, match_status = MATCH_NONE;",
+    "    match_list_ele_t *new_match;",
+    "    if (nfa->expression_hash != EMITTED_EXPRESSION_HASH)",
+    "        /* built for another expression, or other flags */",
+    "        return search_buffer_nfa(buf, bufsize, nfa, match_list, case_insensitive,",
+    "                                 match_full_words, match_full_lines, invert_match);",
+    "    if (match_full_lines) {",
+    "        if (buf[0] == '\\0' || !start_symbols[(unsigned char)buf[0]] || match_list->head != NULL)",
+    "            return (invert_match ? MATCH_FOUND : MATCH_NONE);",
+    "        end = 0;",
+    "        match_status = match_at(buf, bufsize, 0, &end);",
+    "        if (buf[end] != '\\0')",
+    "            return (invert_match ? MATCH_FOUND : MATCH_NONE);",
+    "        new_match = malloc(sizeof(match_list_ele_t));",
+    "        new_match->start = 0;",
+    "        new_match->end = end;",
+    "        new_match->next = NULL;",
+    "        match_list->head = new_match;",
+    "        match_list->tail = new_match;",
+    "        goto RETURN_OR_INVERT_STATUS;",
+    "    }",
+    "    for (pos = 0; pos < bufsize && buf[pos] != '\\0'; pos++) {",
+    "        if (!start_symbols[(unsigned char)buf[pos]])",
+    "            goto NEXT_START;",
+    "        end = 0;",
+    "        status = match_at(buf, bufsize, pos, &end);",
+    "        if (match_full_words && buf[end] != '\\0' && buf[end] != ' ' && buf[end] != '\\t') {",
+    "            status = MATCH_NONE;",
+    "            end = 0;",
+    "        }",
+    "        if (status == MATCH_PROGRESS || (status == MATCH_FOUND && match_status == MATCH_NONE))",
+    "            match_status = status;",
+    "        if (end > pos) {",
+    "            new_match = malloc(sizeof(match_list_ele_t));",
+    "            new_match->start = pos;",
+    "            new_match->end = end;",
+    "            new_match->next = NULL;",
+    "            if (match_list->head == NULL)",
+    "                match_list->head = new_match;",
+    "            else",
+    "                match_list->tail->next = new_match;",
+    "            match_list->tail = new_match;",
+    "            if (!match_full_words)",
+    "                pos = end - 1;",
+    "        }",
+    "NEXT_START:",
+    "        if (match_full_words) {",
+    "            /* the next match may only start after whitespace */",
+    "            while (pos < bufsize && buf[pos] != '\\0' && buf[pos] != ' ' && buf[pos] != '\\t')",
+    "                pos++;",
+    "            if (pos == bufsize || buf[pos] == '\\0')",
+    "                break;",
+    "        }",
+    "    }",
+    "RETURN_OR_INVERT_STATUS:",
+    "    if (invert_match) {",
+    "        switch (match_status) {",
+    "        case MATCH_NONE:",
+    "            return MATCH_FOUND;",
+    "        case MATCH_PROGRESS:",
+    "            return MATCH_PROGRESS;",
+    "        case MATCH_FOUND:",
+    "            return MATCH_NONE;",
+    "        }",
+    "    }",
+    "    return match_status;",
+    "}",
+    NULL,
+};
+
+
+void emit_source(FILE *outfile, dfa_builder_t *builder, nfa_t *nfa,
+                 char *expression, int case_insensitive) {
+    char **line;
+    int id, symbol, starts, start_targeted = 0;
+    emit_expression_comment(outfile, expression);
+    fprintf(outfile, " * %s. Place this file in src/ and rebuild to replace the\n",
+            case_insensitive ? "with case folding built in" : "matching case exactly");
+    fprintf(outfile, " * default search_buffer() with one specialized for the expression. Any\n");
+    fprintf(outfile, " * other expression, or flags, is still searched with the nfa. */\n\n");
+    fprintf(outfile, "#include <stdio.h>\n#include <stdlib.h>\n#include <pthread.h>\n\n");
+    fprintf(outfile, "#include \"include/nfa.h\"\n\n\n");
+    fprintf(outfile, "/* hash_expression() of the expression and flags generated for */\n");
+    fprintf(outfile, "#define EMITTED_EXPRESSION_HASH     0x%llxULL\n\n\n", nfa->expression_hash);
+    fprintf(outfile, "/* Nonzero for each byte which may begin a match */\n");
+    fprintf(outfile, "static const unsigned char start_symbols[256] = {");
+    /* taken from the start of the dfa, which already holds every state
+     * reached from q0 without reading a symbol. If that accepts, even a
+     * start at which no symbol is read matches. */
+    for (symbol = 0; symbol < 256; symbol++) {
+        starts = symbol != 0 && (builder->dfa_states[0].accepting ||
+                                 builder->dfa_states[0].next[symbol] != NO_DFA_STATE);
+        fprintf(outfile, "%s%d,", (symbol % 16 == 0) ? "\n    " : " ", starts);
+    }
+    fprintf(outfile, "\n};\n\n\n");
+    fprintf(outfile, "/* Runs the dfa from buf[pos], storing the end of the longest match in\n");
+    fprintf(outfile, " * *end, and returning the status of the search from pos */\n");
+    fprintf(outfile, "static match_status_t match_at(char *buf, size_t bufsize, size_t pos, size_t *end) {\n");
+    fprintf(outfile, "    size_t last = bufsize - 1;\n");
+    fprintf(outfile, "    match_status_t status = MATCH_NONE;\n");
+    /* the dfa starts by falling into S0, whose label is unused otherwise */
+    for (id = 0; id < builder->dfa_state_count; id++) {
+        for (symbol = 1; symbol < 256; symbol++)
+            start_targeted |= (builder->dfa_states[id].next[symbol] == 0);
+    }
+    for (id = 0; id < builder->dfa_state_count; id++)
+        emit_dfa_state(outfile, builder, id, id != 0 || start_targeted);
+    fprintf(outfile, "}\n\n\n");
+    for (line = search_buffer_source; *line != NULL; line++)
+        fprintf(outfile, "%s\n", *line);
+}
+
+
+/* Writes C source for a search_buffer() specialized to the nfa, which runs
+ * a dfa compiled into labelled blocks with one switch on each input byte.
+ * Returns 0 on success, or 1 if the dfa has too many states to emit. */
+int emit_c(nfa_t *nfa, char *expression, int case_insensitive, FILE *outfile) {
+    dfa_builder_t builder;
+    int i, status = 0;
+    builder.states = calloc(nfa->state_count, sizeof(state_t *));
+    index_states(builder.states, nfa->q0);
+    builder.qaccept_id = nfa->qaccept->id;
+    builder.width = 1 + nfa->counter_count;
+    builder.dfa_states = malloc(sizeof(dfa_state_t) * EMIT_MAX_STATES);
+    builder.dfa_state_count = 0;
+    for (i = 0; i < DFA_HASH_BUCKETS; i++)
+        builder.buckets[i] = NO_DFA_STATE;
+    builder.set = NULL;
+    builder.set_count = 0;
+    builder.set_capacity = 0;
+    if (build_dfa(&builder, nfa, case_insensitive) == 0) {
+        emit_source(outfile, &builder, nfa, expression, case_insensitive);
+    } else {
+        fprintf(stderr, "ERROR: expression needs more than %d dfa states: %s\n",
+                EMIT_MAX_STATES, expression);
+        status = 1;
+    }
+    for (i = 0; i < builder.dfa_state_count; i++)
+        free(builder.dfa_states[i].configs);
+    free(builder.dfa_states);
+    free(builder.set);
+    free(builder.states);
+    return status;
+}
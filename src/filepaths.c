@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "include/nfa.h"
+#include "include/filepaths.h"
+#include "include/index.h"
+#include "include/search.h"
+#include "include/compress.h"
+
+
+/* Bytes at the start of a file checked for a '\0' to tell if it is binary */
+#define SNIFF_BYTES 4096
+
+
+/* The patterns of the ignore files in a directory being walked, which
+ * apply to everything beneath it, linked to those of the directories
+ * above it. Each directory's ignore files are read once, when the walk
+ * enters it. */
+typedef struct ignore_dir {
+    path_glob_t *globs;     /* last pattern in the files first, since it takes precedence */
+    size_t prefix_len;      /* length of the directory's path, including a trailing '/' */
+    struct ignore_dir *parent;
+} ignore_dir_t;
+
+
+char *join_path(char *dir, char *name) {
+    size_t dir_len = strlen(dir);
+    char *path = malloc(sizeof(char) * (dir_len + strlen(name) + 2));
+    strcpy(path, dir);
+    if (dir_len == 0 || dir[dir_len - 1] != '/')
+        path[dir_len++] = '/';
+    strcpy(path + dir_len, name);
+    return path;
+}
+
+
+/* Returns the length of the bracket expression at the start of pattern,
+ * storing in matched whether c is one of its members, or 0 if it has no
+ * closing bracket, in which case the '[' is an ordinary symbol */
+size_t match_glob_bracket(char *pattern, char c, int *matched) {
+    size_t len = 1;
+    int negate = 0;
+    char lo, hi;
+    *matched = 0;
+    if (pattern[len] == '!' || pattern[len] == '^') {
+        negate = 1;
+        len++;
+    }
+    do {
+        if (pattern[len] == '\0')
+            return 0;
+        if (pattern[len] == '\\' && pattern[len + 1] != '\0')
+            len++;
+        lo = hi = pattern[len++];
+        if (pattern[len] == '-' && pattern[len + 1] != ']' && pattern[len + 1] != '\0') {
+            hi = pattern[len + 1];
+            len += 2;
+        }
+        if (c >= lo && c <= hi)
+            *matched = 1;
+    } while (pattern[len] != ']');
+    *matched ^= negate;
+    return len + 1;
+}
+
+
+/* Returns nonzero if the glob matches all of string. '*' and '?' do not
+ * match '/', but '**' matches any number of directories. */
+int glob_matches(char *pattern, char *string) {
+    size_t len;
+    int matched;
+    while (*pattern != '\0') {
+        switch (*pattern) {
+        case '*':
+            if (pattern[1] == '*') {
+                pattern += 2;
+                /* leading or inner '**' followed by '/' may match no directories */
+                if (*pattern == '/' && glob_matches(pattern + 1, string))
+                    return 1;
+                for (;; string++) {
+                    if (glob_matches(pattern, string))
+                        return 1;
+                    if (*string == '\0')
+                        return 0;
+                }
+            }
+            for (pattern++;; string++) {
+                if (glob_matches(pattern, string))
+                    return 1;
+                if (*string == '\0' || *string == '/')
+                    return 0;
+            }
+        case '?':
+            if (*string == '\0' || *string == '/')
+                return 0;
+            pattern++;
+            string++;
+            break;
+        case '[':
+            if ((len = match_glob_bracket(pattern, *string, &matched)) != 0) {
+                if (*string == '\0' || *string == '/' || !matched)
+                    return 0;
+                pattern += len;
+                string++;
+                break;
+            }
+            /* implied else: unclosed, so an ordinary symbol */
+            if (*string++ != *pattern++)
+                return 0;
+            break;
+        case '\\':
+            if (pattern[1] != '\0')
+                pattern++;
+            /* fall through */
+        default:
+            if (*string++ != *pattern++)
+                return 0;
+        }
+    }
+    return *string == '\0';
+}
+
+
+/* Returns nonzero if the compiled glob matches all of string */
+int path_glob_matches(path_glob_t *glob, char *string) {
+    size_t len;
+    switch (glob->kind) {
+    case GLOB_LITERAL:
+        return strcmp(glob->pattern, string) == 0;
+    case GLOB_SUFFIX:
+        len = strlen(string);
+        return len >= glob->len &&
+               memcmp(string + len - glob->len, glob->pattern, glob->len) == 0 &&
+               memchr(string, '/', len - glob->len) == NULL;
+    default:
+        return glob_matches(glob->pattern, string);
+    }
+}
+
+
+/* Compiles the glob, and pushes it onto the list next. The syntax of
+ * ignore files is handled by the caller. */
+path_glob_t *compile_glob(char *pattern, path_glob_t *next) {
+    path_glob_t *glob = malloc(sizeof(path_glob_t));
+    glob->kind = GLOB_GENERAL;
+    if (strpbrk(pattern, "*?[\\") == NULL)
+        glob->kind = GLOB_LITERAL;
+    else if (pattern[0] == '*' && strpbrk(pattern + 1, "*?[\\") == NULL)
+        glob->kind = GLOB_SUFFIX;
+    if (glob->kind == GLOB_SUFFIX)
+        pattern++;
+    glob->len = strlen(pattern);
+    glob->pattern = malloc(glob->len + 1);
+    strcpy(glob->pattern, pattern);
+    glob->negate = 0;
+    glob->dir_only = 0;
+    glob->anchored = 0;
+    glob->next = next;
+    return glob;
+}
+
+
+void free_globs(path_glob_t *globs) {
+    path_glob_t *tmp;
+    while (globs != NULL) {
+        tmp = globs;
+        globs = globs->next;
+        free(tmp->pattern);
+        free(tmp);
+    }
+}
+
+
+/* Compiles a line of an ignore file, following the rules of .gitignore,
+ * and pushes it onto globs */
+path_glob_t *compile_ignore_line(char *line, path_glob_t *globs) {
+    size_t len = strlen(line);
+    int negate = 0, dir_only = 0, anchored;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        len--;
+    /* trailing spaces are ignored, unless escaped */
+    while (len > 0 && line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\'))
+        len--;
+    line[len] = '\0';
+    if (len == 0 || line[0] == '#')
+        return globs;
+    if (line[0] == '!') {
+        negate = 1;
+        line++;
+        len--;
+    }
+    if (len > 0 && line[len - 1] == '/') {
+        dir_only = 1;
+        line[--len] = '\0';
+    }
+    /* a slash other than at the end ties the pattern to this directory */
+    anchored = (strchr(line, '/') != NULL);
+    if (line[0] == '/')
+        line++;
+    if (line[0] == '\0')
+        return globs;
+    globs = compile_glob(line, globs);
+    globs->negate = negate;
+    globs->dir_only = dir_only;
+    globs->anchored = anchored;
+    return globs;
+}
+
+
+/* Pushes the patterns of the ignore file at path onto globs */
+path_glob_t *load_ignore_file(char *path, path_glob_t *globs) {
+    FILE *infile;
+    char *line = NULL;
+    size_t linesize = 0;
+    if ((infile = fopen(path, "r")) == NULL)
+        return globs;
+    while (getline(&line, &linesize, infile) != -1)
+        globs = compile_ignore_line(line, globs);
+    free(line);
+    fclose(infile);
+    return globs;
+}
+
+
+/* Returns the ignore patterns for the directory at path, read from its
+ * .gitignore and then its .ignore, which takes precedence, on top of those
+ * of its parents. Returns parent itself if it has neither. */
+ignore_dir_t *enter_ignore_dir(char *path, ignore_dir_t *parent) {
+    ignore_dir_t *ignores;
+    path_glob_t *globs;
+    char *ignore_path;
+    ignore_path = join_path(path, ".gitignore");
+    globs = load_ignore_file(ignore_path, NULL);
+    free(ignore_path);
+    ignore_path = join_path(path, ".ignore");
+    globs = load_ignore_file(ignore_path, globs);
+    free(ignore_path);
+    if (globs == NULL)
+        return parent;
+    ignores = malloc(sizeof(ignore_dir_t));
+    ignores->globs = globs;
+    ignores->prefix_len = strlen(path);
+    if (ignores->prefix_len == 0 || path[ignores->prefix_len - 1] != '/')
+        ignores->prefix_len++;
+    ignores->parent = parent;
+    return ignores;
+}
+
+
+/* Returns nonzero if the ignore files of the directories walked to reach
+ * the entry at path, named name, exclude it. The last pattern matching it
+ * decides, and patterns in deeper directories come later. */
+int is_ignored(ignore_dir_t *ignores, char *path, char *name, int is_dir) {
+    path_glob_t *glob;
+    for (; ignores != NULL; ignores = ignores->parent) {
+        for (glob = ignores->globs; glob != NULL; glob = glob->next) {
+            if (glob->dir_only && !is_dir)
+                continue;
+            if (path_glob_matches(glob, glob->anchored ? path + ignores->prefix_len : name))
+                return !glob->negate;
+        }
+    }
+    return 0;
+}
+
+
+/* Returns nonzero if the first block of the file at path holds a '\0', as
+ * text files never do, unless the file is compressed and search_compressed
+ * is set. Files which cannot be read are left for the search to report. */
+int sniff_binary(char *path, int search_compressed) {
+    char block[SNIFF_BYTES];
+    ssize_t bytes;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    bytes = read(fd, block, sizeof(block));
+    close(fd);
+    if (bytes <= 0 || (search_compressed &&
+                       detect_compression((unsigned char *)block, bytes) != COMPRESSION_NONE))
+        return 0;
+    return memchr(block, '\0', bytes) != NULL;
+}
+
+
+/* Returns nonzero if the filter skips the regular file at path, named
+ * name. The cheapest checks come first, so that the file is only stat'ed
+ * if there is a size limit, and only opened if binaries are skipped. */
+int is_filtered(file_filter_t *filter, char *path, char *name) {
+    path_glob_t *glob;
+    struct stat st;
+    if (filter->includes != NULL) {
+        for (glob = filter->includes; glob != NULL; glob = glob->next) {
+            if (path_glob_matches(glob, name))
+                break;
+        }
+        if (glob == NULL)
+            return 1;
+    }
+    for (glob = filter->excludes; glob != NULL; glob = glob->next) {
+        if (path_glob_matches(glob, name))
+            return 1;
+    }
+    if (filter->max_filesize != 0 && lstat(path, &st) == 0 &&
+            (unsigned long long)st.st_size > filter->max_filesize)
+        return 1;
+    return filter->skip_binary && sniff_binary(path, filter->search_compressed);
+}
+
+
+/* Appends to the list every regular file in the directory at path and its
+ * subdirectories, in the order in which readdir() returns them. Symbolic
+ * links within the directory are not followed. The type reported by
+ * readdir() is used when available, so that files need not be stat'ed.
+ * If filter is not NULL, index files and the files and directories which
+ * it skips are left out. ignores holds the ignore patterns of the
+ * directories above. Directories which cannot be opened are reported on
+ * errfile. */
+void add_directory_filepaths(char *path, struct filepath_node ***tail,
+                             file_filter_t *filter, ignore_dir_t *ignores,
+                             FILE *errfile) {
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    ignore_dir_t *dir_ignores = ignores;
+    char *entry_path;
+    int is_dir, is_reg;
+    if ((dir = opendir(path)) == NULL) {
+        fprintf(errfile, "ERROR: could not open directory: %s\n", path);
+        return;
+    }
+    if (filter != NULL && filter->use_ignore_files)
+        dir_ignores = enter_ignore_dir(path, ignores);
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        entry_path = join_path(path, entry->d_name);
+        is_dir = (entry->d_type == DT_DIR);
+        is_reg = (entry->d_type == DT_REG);
+        if (entry->d_type == DT_UNKNOWN && lstat(entry_path, &st) == 0) {
+            is_dir = S_ISDIR(st.st_mode);
+            is_reg = S_ISREG(st.st_mode);
+        }
+        if (filter != NULL && filter->use_ignore_files && (is_dir || is_reg) &&
+                ((is_dir && strcmp(entry->d_name, ".git") == 0) ||
+                 is_ignored(dir_ignores, entry_path, entry->d_name, is_dir))) {
+            free(entry_path);
+            continue;
+        }
+        if (is_dir) {
+            add_directory_filepaths(entry_path, tail, filter, dir_ignores, errfile);
+            free(entry_path);
+        } else if (is_reg && filter != NULL && (strcmp(entry->d_name, INDEX_FILENAME) == 0 ||
+                                                is_filtered(filter, entry_path, entry->d_name))) {
+            free(entry_path);
+        } else if (is_reg) {
+            **tail = malloc(sizeof(struct filepath_node));
+            (**tail)->path = entry_path;
+            (**tail)->next = NULL;
+            *tail = &(**tail)->next;
+        } else {
+            free(entry_path);
+        }
+    }
+    closedir(dir);
+    if (dir_ignores != ignores) {
+        free_globs(dir_ignores->globs);
+        free(dir_ignores);
+    }
+}
+
+
+/* Returns a list of the files to search within filepath, which may be a
+ * single file, or a directory to search recursively. Only files within a
+ * directory are subject to the filter, which may be NULL. Paths which
+ * cannot be found or opened are reported on errfile. */
+struct filepath_node *build_recursive_filepaths_list(char *filepath, file_filter_t *filter,
+                                                     FILE *errfile) {
+    struct filepath_node *head = NULL, **tail = &head;
+    struct stat st;
+    if (stat(filepath, &st) == -1) {
+        fprintf(errfile, "ERROR: no such file or directory: %s\n", filepath);
+        return NULL;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        /* If filename is a directory, recursively add files in filename */
+        add_directory_filepaths(filepath, &tail, filter, NULL, errfile);
+    } else {
+        /* If filename is not a directory, add it to list */
+        head = malloc(sizeof(struct filepath_node));
+        head->path = malloc(sizeof(char) * (strlen(filepath) + 1));
+        strcpy(head->path, filepath);
+        head->next = NULL;
+    }
+    return head;
+}
+
+
+/* Returns a list of the given paths, in order, without checking them */
+struct filepath_node *build_filepaths_list(char **paths, int path_count) {
+    struct filepath_node *head = NULL, **tail = &head;
+    int i;
+    for (i = 0; i < path_count; i++) {
+        *tail = malloc(sizeof(struct filepath_node));
+        (*tail)->path = malloc(sizeof(char) * (strlen(paths[i]) + 1));
+        strcpy((*tail)->path, paths[i]);
+        (*tail)->next = NULL;
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+
+void cleanup_filepaths(struct filepath_node *filepaths) {
+    struct filepath_node *tmp;
+    while (filepaths != NULL) {
+        tmp = filepaths;
+        filepaths = filepaths->next;
+        free(tmp->path);
+        free(tmp);
+    }
+}
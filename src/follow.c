@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "include/follow.h"
+
+
+/* Longest wait for an inotify event before checking the file anyway, in
+ * case no event arrives, eg. when inotify is unavailable */
+#define FOLLOW_POLL_MS  1000
+
+#define FOLLOW_EVENT_BUFSIZE    4096
+
+
+/* State behind a stream returned by open_follow(). Reads block at the end
+ * of the file until it grows, so a search reading a partial line simply
+ * waits for the rest of it, and nothing is ever read twice. */
+typedef struct follow_file {
+    char *path;
+    int fd;
+    off_t offset;       /* bytes of the current file read so far */
+    int inotify_fd;     /* -1 if inotify is unavailable */
+    int file_watch;     /* watch on the current file, or -1 */
+    FILE *flush;        /* flushed before waiting for the file to grow */
+    char last_byte;     /* last byte returned, or '\n' before the first */
+} follow_file_t;
+
+
+void watch_followed_file(follow_file_t *follow) {
+    if (follow->inotify_fd < 0)
+        return;
+    if (follow->file_watch >= 0)
+        inotify_rm_watch(follow->inotify_fd, follow->file_watch);
+    follow->file_watch = inotify_add_watch(follow->inotify_fd, follow->path,
+                                           IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+
+/* Watches the directory containing the file, to notice a new file being
+ * created in its place when it is rotated */
+void watch_followed_dir(follow_file_t *follow) {
+    char *slash = strrchr(follow->path, '/');
+    char *dir;
+    if (follow->inotify_fd < 0)
+        return;
+    if (slash == NULL) {
+        inotify_add_watch(follow->inotify_fd, ".", IN_CREATE | IN_MOVED_TO);
+        return;
+    }
+    dir = malloc(slash - follow->path + 2);
+    memcpy(dir, follow->path, slash - follow->path + 1);
+    /* keep the slash only if it is the root directory */
+    dir[(slash == follow->path) ? 1 : slash - follow->path] = '\0';
+    inotify_add_watch(follow->inotify_fd, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+}
+
+
+/* Starts reading the file from the beginning if it has been truncated.
+ * Returns nonzero if it was. */
+int rewind_if_truncated(follow_file_t *follow) {
+    struct stat st;
+    if (fstat(follow->fd, &st) != 0 || st.st_size >= follow->offset)
+        return 0;
+    lseek(follow->fd, 0, SEEK_SET);
+    follow->offset = 0;
+    return 1;
+}
+
+
+/* Switches to the file now at the path if it is no longer the file being
+ * read, eg. after log rotation. Only called once the current file has been
+ * read to its end. Returns nonzero if the file was switched. */
+int reopen_if_replaced(follow_file_t *follow) {
+    struct stat current, named;
+    int fd;
+    if (stat(follow->path, &named) != 0 || fstat(follow->fd, &current) != 0 ||
+            (named.st_dev == current.st_dev && named.st_ino == current.st_ino))
+        return 0;
+    fd = open(follow->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    close(follow->fd);
+    follow->fd = fd;
+    follow->offset = 0;
+    watch_followed_file(follow);
+    return 1;
+}
+
+
+/* Blocks until an inotify event arrives, or for at most FOLLOW_POLL_MS */
+void wait_for_change(follow_file_t *follow) {
+    struct pollfd pfd;
+    char events[FOLLOW_EVENT_BUFSIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    pfd.fd = follow->inotify_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, follow->inotify_fd >= 0 ? 1 : 0, FOLLOW_POLL_MS) > 0 &&
+            (pfd.revents & POLLIN)) {
+        /* the events only wake the reader, which then checks the file */
+        while (read(follow->inotify_fd, events, sizeof(events)) > 0)
+            ;
+    }
+}
+
+
+ssize_t read_followed_file(void *cookie, char *buf, size_t size) {
+    follow_file_t *follow = (follow_file_t *)cookie;
+    ssize_t bytes;
+    while (1) {
+        bytes = read(follow->fd, buf, size);
+        if (bytes > 0) {
+            follow->offset += bytes;
+            follow->last_byte = buf[bytes - 1];
+            return bytes;
+        }
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0)
+            return -1;
+        if (rewind_if_truncated(follow) || reopen_if_replaced(follow)) {
+            if (follow->last_byte != '\n') {
+                /* end the partial line read from the old contents, rather
+                 * than join it to the first line of the new ones */
+                follow->last_byte = '\n';
+                buf[0] = '\n';
+                return 1;
+            }
+            continue;
+        }
+        /* make everything found so far visible before waiting */
+        if (follow->flush != NULL)
+            fflush(follow->flush);
+        wait_for_change(follow);
+    }
+}
+
+
+int close_followed_file(void *cookie) {
+    follow_file_t *follow = (follow_file_t *)cookie;
+    close(follow->fd);
+    if (follow->inotify_fd >= 0)
+        close(follow->inotify_fd);
+    free(follow->path);
+    free(follow);
+    return 0;
+}
+
+
+/* Opens the file at path as a stream which never reaches EOF. At the end
+ * of the file, reads wait for it to grow, after flushing flush if it is
+ * not NULL. If the file is truncated it is read again from the start, and
+ * if it is replaced, eg. by log rotation, the new file is read instead. A
+ * partial line left from before either is ended with a newline of its own.
+ * Returns NULL if the file cannot be opened. */
+FILE *open_follow(char *path, FILE *flush) {
+    follow_file_t *follow;
+    cookie_io_functions_t functions;
+    FILE *stream;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    follow = malloc(sizeof(follow_file_t));
+    follow->path = malloc(strlen(path) + 1);
+    strcpy(follow->path, path);
+    follow->fd = fd;
+    follow->offset = 0;
+    follow->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    follow->file_watch = -1;
+    follow->flush = flush;
+    follow->last_byte = '\n';
+    watch_followed_file(follow);
+    watch_followed_dir(follow);
+    memset(&functions, 0, sizeof(functions));
+    functions.read = &read_followed_file;
+    functions.close = &close_followed_file;
+    stream = fopencookie(follow, "r", functions);
+    if (stream == NULL)
+        close_followed_file(follow);
+    return stream;
+}
@@ -0,0 +1,15 @@
+#ifndef CACHE_H
+#define CACHE_H   1
+
+
+#define FNV_OFFSET_BASIS    0xcbf29ce484222325ULL
+#define FNV_PRIME           0x100000001b3ULL
+
+uint64_t fnv1a(uint64_t hash, void *data, size_t len);
+
+nfa_t *load_cached_nfa(char *expression, int key_flags);
+
+void store_cached_nfa(nfa_t *nfa, char *expression, int key_flags);
+
+
+#endif  /* #ifndef CACHE_H */
@@ -0,0 +1,33 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H   1
+
+
+/* How far a file was searched, and how to recognize it again */
+typedef struct checkpoint_entry {
+    char *path;                     /* canonical path of the file */
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long offset;      /* end of the last line searched */
+    unsigned long long lines;       /* lines before offset */
+    unsigned long long fingerprint; /* hash of content before offset */
+    struct checkpoint_entry *next;  /* next entry in the same bucket */
+} checkpoint_entry_t;
+
+typedef struct checkpoint {
+    char *filename;
+    checkpoint_entry_t **buckets;   /* entries, hashed by path */
+    size_t bucket_count;
+    size_t entry_count;
+} checkpoint_t;
+
+checkpoint_t *load_checkpoint(char *filename);
+
+int save_checkpoint(checkpoint_t *checkpoint);
+
+void free_checkpoint(checkpoint_t *checkpoint);
+
+FILE *open_checkpointed(checkpoint_t *checkpoint, char *path, FILE *infile,
+                        size_t *lines_skipped);
+
+
+#endif  /* #ifndef CHECKPOINT_H */
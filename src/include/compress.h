@@ -0,0 +1,19 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H   1
+
+
+typedef enum {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,   /* gzip, with any number of members */
+    COMPRESSION_ZSTD,   /* zstd, with any number of frames */
+} compression_t;
+
+compression_t detect_compression(unsigned char *bytes, size_t len);
+
+FILE *open_decompressed(FILE *infile, char *filename, FILE *errfile);
+
+match_status_t search_compressed_file(char *filename, FILE *infile, nfa_t *nfa,
+                                      search_opts_t *opts);
+
+
+#endif  /* #ifndef COMPRESS_H */
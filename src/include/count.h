@@ -0,0 +1,8 @@
+#ifndef COUNT_H
+#define COUNT_H   1
+
+
+int count_by_pattern(char *pattern_file, char **paths, int path_count, search_opts_t *opts);
+
+
+#endif  /* #ifndef COUNT_H */
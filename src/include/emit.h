@@ -0,0 +1,8 @@
+#ifndef EMIT_H
+#define EMIT_H   1
+
+
+int emit_c(nfa_t *nfa, char *expression, int case_insensitive, FILE *outfile);
+
+
+#endif  /* #ifndef EMIT_H */
@@ -0,0 +1,53 @@
+#ifndef FILEPATHS_H
+#define FILEPATHS_H   1
+
+
+typedef struct filepath_node {
+    char *path;
+    struct filepath_node *next;
+} filepath_node_t;
+
+/* How a glob is matched. Most globs in ignore files are plain names or
+ * extensions, which need no general matching. */
+typedef enum {
+    GLOB_LITERAL,   /* no wildcards, so compared as a string */
+    GLOB_SUFFIX,    /* '*' followed by a literal, such as *.o */
+    GLOB_GENERAL,
+} glob_kind_t;
+
+/* A compiled shell-style glob, from an ignore file or --include/--exclude */
+typedef struct path_glob {
+    char *pattern;      /* for GLOB_SUFFIX, the literal after the '*' */
+    size_t len;
+    glob_kind_t kind;
+    int negate;         /* pattern began with '!', so re-includes what it matches */
+    int dir_only;       /* pattern ended with '/', so only matches directories */
+    int anchored;       /* matched against the path from the ignore file's directory,
+                         * rather than against the name alone */
+    struct path_glob *next;
+} path_glob_t;
+
+/* Which files a recursive search skips, without reading or even opening
+ * them where possible */
+typedef struct file_filter {
+    path_glob_t *includes;  /* if not NULL, only files whose names match one are kept */
+    path_glob_t *excludes;  /* files whose names match one are skipped */
+    unsigned long long max_filesize;    /* larger files are skipped, unless 0 */
+    int use_ignore_files;   /* skip .git, and whatever .gitignore and .ignore files list */
+    int skip_binary;        /* skip files with a '\0' in their first block */
+    int search_compressed;  /* compressed files are not skipped as binary */
+} file_filter_t;
+
+path_glob_t *compile_glob(char *pattern, path_glob_t *next);
+
+void free_globs(path_glob_t *globs);
+
+struct filepath_node *build_recursive_filepaths_list(char *filepath, file_filter_t *filter,
+                                                     FILE *errfile);
+
+struct filepath_node *build_filepaths_list(char **paths, int path_count);
+
+void cleanup_filepaths(struct filepath_node *filepaths);
+
+
+#endif  /* #ifndef FILEPATHS_H */
@@ -0,0 +1,8 @@
+#ifndef FOLLOW_H
+#define FOLLOW_H   1
+
+
+FILE *open_follow(char *path, FILE *flush);
+
+
+#endif  /* #ifndef FOLLOW_H */
@@ -0,0 +1,12 @@
+#ifndef INDEX_H
+#define INDEX_H   1
+
+
+#define INDEX_FILENAME  ".perg_index"
+
+int build_index(char *dir);
+
+struct filepath_node *filter_filepaths_by_index(char *dir, struct filepath_node *filepaths, nfa_t *nfa);
+
+
+#endif  /* #ifndef INDEX_H */
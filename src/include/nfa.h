@@ -13,14 +13,31 @@ typedef enum {
     FLAG_EPSILON,   /* do not advance read head */
     FLAG_WILDCARD,  /* the '.' symbol, match any single symbol */
     FLAG_INVERT,    /* succeeded by '!' symbol */
+    FLAG_CLASS,     /* bracket expression, match any symbol in class_bitmap */
+    FLAG_COUNT_LOOP,    /* epsilon, repeat again if counter + 1 < repeat_count */
+    FLAG_COUNT_EXIT,    /* epsilon, leave repetition if counter + 1 == repeat_count */
 } t_flag_t;
 
+#define IS_EPSILON(flags)   ((flags) == FLAG_EPSILON || \
+                             (flags) == FLAG_COUNT_LOOP || \
+                             (flags) == FLAG_COUNT_EXIT)
+
+/* A bracket expression is compiled into a 256-bit membership bitmap, with
+ * one bit for each possible byte value, so testing a symbol is one lookup. */
+#define CLASS_BITMAP_BYTES  32
+#define CLASS_HAS(bitmap, c)    ((bitmap)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+#define CLASS_SET(bitmap, c)    ((bitmap)[(unsigned char)(c) >> 3] |= (1 << ((unsigned char)(c) & 7)))
+#define CLASS_CLEAR(bitmap, c)  ((bitmap)[(unsigned char)(c) >> 3] &= ~(1 << ((unsigned char)(c) & 7)))
+
 typedef struct state state_t;
 
 typedef struct transition_list {
     state_t *next_state;
     struct transition_list *next;
     struct transition_list *prev;
+    unsigned char *class_bitmap;    /* only used by FLAG_CLASS */
+    int counter_id;                 /* only used by FLAG_COUNT_* */
+    unsigned int repeat_count;      /* only used by FLAG_COUNT_* */
     char symbol;
     t_flag_t flags;
 } transition_t;
@@ -30,14 +47,50 @@ struct state {
     struct state *next; /* for internal list of states */
     struct state *prev; /* for internal list of states */
     int id;
+    int pattern_id;     /* pattern accepted here in a union nfa, or -1 */
 };
 
+typedef enum {
+    NFA_STORAGE_STATES, /* states and transitions allocated by build_nfa() */
+    NFA_STORAGE_HEAP,   /* flattened image in a single heap block */
+    NFA_STORAGE_MAPPED, /* flattened image in a mapped file */
+} nfa_storage_t;
+
 typedef struct nfa {
     state_t *q0;
     state_t *qaccept;
     size_t expr_len;
+    int counter_count;  /* number of counted repetitions, each with a counter */
+    int state_count;    /* states have ids 0 through state_count - 1 */
+    unsigned long long expression_hash; /* of the expression and the flags it
+                                         * was built with, or 0 for a union */
+    nfa_storage_t storage;
+    void *image;        /* block to free or unmap, if not NFA_STORAGE_STATES */
+    size_t image_size;
 } nfa_t;
 
+/* A flattened nfa is a single relocatable block: this header, followed by
+ * the array of states indexed by id, followed by each state's transitions
+ * in list order (each FLAG_CLASS transition directly followed by its
+ * bitmap). Every pointer within the image is stored as its offset from the
+ * start of the image, so the image can be written to a file as is, and made
+ * usable again by a single relocation pass, without parsing or allocating. */
+typedef struct nfa_image_header {
+    nfa_t nfa;
+    size_t state_count;
+} nfa_image_header_t;
+
+/* Patterns of a union nfa found in the current buffer. A thread reaching a
+ * pattern's accepting state swaps the buffer's stamp into the pattern's
+ * slot, and only the thread which changes it records the hit, so each
+ * pattern is recorded once per buffer without locking. */
+typedef struct pattern_hits {
+    unsigned long stamp;    /* unique to each buffer searched */
+    unsigned long *stamps;  /* stamp of the last buffer each pattern was found in */
+    int *hits;              /* ids of the patterns found in this buffer */
+    int hit_count;
+} pattern_hits_t;
+
 typedef struct nfa_arg {
     char *buf;
     size_t bufsize;
@@ -46,6 +99,9 @@ typedef struct nfa_arg {
     size_t pos;
     size_t end;
     int case_insensitive;
+    int counter_count;
+    unsigned int *counters; /* this thread's iteration of each repetition */
+    pattern_hits_t *hits;   /* where to record patterns found, or NULL */
 } nfa_arg_t;
 
 typedef struct plet {
@@ -65,13 +121,37 @@ typedef struct match_list {
     match_list_ele_t *tail;
 } match_list_t;
 
-nfa_t *build_nfa(char *expression, int case_insensitive);
+unsigned long long hash_expression(char *expression, int case_insensitive, int utf8);
+
+nfa_t *build_nfa(char *expression, int case_insensitive, int utf8);
+
+nfa_t *build_union_nfa(char **expressions, int expression_count, int case_insensitive,
+                       int utf8);
 
 void print_nfa(nfa_t *nfa, FILE *outfile);
 
+void set_build_errfile(FILE *errfile);
+
+void cleanup_states();
+
 void free_nfa(nfa_t *nfa);
 
+size_t flatten_nfa(nfa_t *nfa, char **image);
+
+char *required_literals(nfa_t *nfa);
+
+nfa_t *relocate_nfa(char *image, size_t image_size, nfa_storage_t storage,
+                    void *block, size_t block_size);
+
+int transition_viable(transition_t *transition, char c, unsigned int *counters);
+
+void apply_counters(transition_t *transition, unsigned int *counters);
+
+match_status_t search_buffer_nfa(char *buf, size_t bufsize, nfa_t *nfa, match_list_t *match_list, int case_insensitive, int match_full_words, int match_full_lines, int invert_match);
+
 match_status_t search_buffer(char *buf, size_t bufsize, nfa_t *nfa, match_list_t *match_list, int case_insensitive, int match_full_words, int match_full_lines, int invert_match);
 
+void find_patterns(char *buf, size_t bufsize, nfa_t *nfa, pattern_hits_t *hits, int case_insensitive);
+
 
 #endif  /* #ifndef NFA_H */
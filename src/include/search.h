@@ -0,0 +1,62 @@
+#ifndef SEARCH_H
+#define SEARCH_H   1
+
+
+typedef enum {
+    ARG_FLAG_NONE   = 0x00000,
+    ARG_FLAG_I      = 0x00001,  /* case insensitive */
+    ARG_FLAG_V      = 0x00002,  /* invert match */
+    ARG_FLAG_W      = 0x00004,  /* match whole words */
+    ARG_FLAG_X      = 0x00008,  /* match whole lines */
+    ARG_FLAG_O      = 0x00010,  /* only print matching part of lines */
+    ARG_FLAG_HH     = 0x00020,  /* print filename before each match */
+    ARG_FLAG_H      = 0x00040,  /* suppress printing filename before each match */
+    ARG_FLAG_N      = 0x00080,  /* prefix each matching line with line number */
+    ARG_FLAG_A      = 0x00100,  /* treat binary files as text */
+    ARG_FLAG_R      = 0x00200,  /* recursively read all files in each given dir */
+
+    /* Ignored for now */
+    ARG_FLAG_C      = 0x00400,
+    ARG_FLAG_LL     = 0x00800,
+    ARG_FLAG_L      = 0x01000,
+    ARG_FLAG_Q      = 0x02000,
+
+    ARG_FLAG_AA     = 0x04000,  /* print lines of context after each match */
+    ARG_FLAG_BB     = 0x08000,  /* print lines of context before each match */
+    ARG_FLAG_CC     = 0x10000,  /* print lines of context around each match */
+
+    /* Long options */
+    ARG_FLAG_CACHE  = 0x20000,  /* load and store compiled expressions in cache */
+    ARG_FLAG_USE_INDEX  = 0x40000,  /* skip files which the trigram index rules out */
+
+    ARG_FLAG_FF     = 0x80000,  /* keep reading the file as it grows */
+    ARG_FLAG_UTF8   = 0x100000, /* symbols are UTF-8 encoded code points */
+    ARG_FLAG_NO_IGNORE  = 0x200000, /* with -r, search .git and ignored files too */
+    ARG_FLAG_Z      = 0x400000, /* decompress gzip and zstd files */
+} arg_flag_t;
+
+/* Everything about how a search is performed and where its output goes,
+ * other than the expression itself */
+typedef struct search_opts {
+    arg_flag_t flags;
+    size_t before_context;
+    size_t after_context;
+    FILE *outfile;
+    FILE *errfile;
+    int color;      /* whether to use color escapes, if outfile is a terminal */
+    struct checkpoint *checkpoint;  /* where to resume files from, or NULL */
+    size_t lines_skipped;   /* lines of the file before the input searched */
+    struct file_filter *filter; /* which files -r skips, or NULL for none */
+    int failed;     /* set once some input could not be read in full */
+} search_opts_t;
+
+size_t fill_buffer(FILE *infile, char **buf, size_t *bufsize, int *binary, arg_flag_t flags);
+
+match_status_t search_file(char *filename, FILE *infile, nfa_t *nfa, search_opts_t *opts);
+
+match_status_t search_filepaths(struct filepath_node *filepaths, nfa_t *nfa, search_opts_t *opts);
+
+match_status_t search_recursive(char *filepath, nfa_t *nfa, search_opts_t *opts);
+
+
+#endif  /* #ifndef SEARCH_H */
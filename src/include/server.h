@@ -0,0 +1,15 @@
+#ifndef SERVER_H
+#define SERVER_H   1
+
+
+/* Returned by run_client() when the server could not run the search, eg.
+ * because the expression is invalid */
+#define CLIENT_ERROR    (-2)
+
+int serve(char *socket_path);
+
+int run_client(char *socket_path, char *expression, char **paths, int path_count,
+               search_opts_t *opts);
+
+
+#endif  /* #ifndef SERVER_H */
@@ -0,0 +1,50 @@
+#ifndef UTF8_H
+#define UTF8_H   1
+
+
+#define UTF8_MAX_CODEPOINT  0x10FFFF
+#define UTF8_MAX_BYTES      4
+
+/* Inclusive range of code points */
+typedef struct codepoint_range {
+    uint32_t lo;
+    uint32_t hi;
+} codepoint_range_t;
+
+/* Set of code points, as ranges which are sorted and disjoint once
+ * normalize_codepoint_set() has been called */
+typedef struct codepoint_set {
+    codepoint_range_t *ranges;
+    size_t count;
+    size_t capacity;
+} codepoint_set_t;
+
+/* The UTF-8 encodings of a range of code points of the same encoded
+ * length, as a range of values for each byte: every sequence of bytes
+ * within the ranges encodes a code point in the range, and vice versa. */
+typedef struct utf8_sequence {
+    unsigned char lo[UTF8_MAX_BYTES];
+    unsigned char hi[UTF8_MAX_BYTES];
+    int len;
+} utf8_sequence_t;
+
+size_t utf8_decode(char *s, uint32_t *codepoint);
+
+int utf8_byte_valid(unsigned char c, int *pending);
+
+void init_codepoint_set(codepoint_set_t *set);
+
+void free_codepoint_set(codepoint_set_t *set);
+
+void add_codepoint_range(codepoint_set_t *set, uint32_t lo, uint32_t hi);
+
+void normalize_codepoint_set(codepoint_set_t *set);
+
+void fold_codepoint_set(codepoint_set_t *set);
+
+void negate_codepoint_set(codepoint_set_t *set);
+
+size_t utf8_sequences(codepoint_set_t *set, utf8_sequence_t **sequences);
+
+
+#endif  /* #ifndef UTF8_H */
@@ -0,0 +1,517 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "include/nfa.h"
+#include "include/filepaths.h"
+#include "include/index.h"
+
+
+/* Bump whenever the layout of the index file changes */
+#define INDEX_FORMAT_VERSION    1
+
+#define INDEX_MAGIC     "PERGIDX"
+
+#define INDEX_BLOCK_SIZE    65536
+
+#define TRIGRAM_SPACE   (1 << 24)
+
+#define FOLD(c)     (((c) >= 0x41 && (c) <= 0x5A) ? ((c) | 0x20) : (c))
+
+#define NO_FILE     UINT32_MAX
+
+
+/* An index file holds, for every file beneath the indexed directory, the set
+ * of (ASCII case folded) trigrams which appear in it. It is laid out as this
+ * header, followed by the file table sorted by path, followed by the trigram
+ * table sorted by trigram, followed by the paths, relative to the indexed
+ * directory, followed by the posting lists. Each posting list holds the ids
+ * of the files containing a trigram, in increasing order, with each id
+ * stored as its difference from the previous one, encoded as a varint. */
+typedef struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t file_count;
+    uint32_t trigram_count;
+    uint32_t reserved;
+    uint64_t paths_size;
+    uint64_t postings_size;
+} index_header_t;
+
+typedef struct index_file {
+    uint64_t mtime;     /* in nanoseconds */
+    uint64_t size;
+    uint64_t path_offset;
+} index_file_t;
+
+typedef struct index_trigram {
+    uint32_t trigram;
+    uint32_t posting_count;
+    uint64_t postings_offset;
+} index_trigram_t;
+
+/* A mapped index file */
+typedef struct index {
+    char *block;
+    size_t size;
+    index_header_t *header;
+    index_file_t *files;
+    index_trigram_t *trigrams;
+    char *paths;
+    unsigned char *postings;
+} index_t;
+
+/* A file to be written into a new index */
+typedef struct index_entry {
+    char *rel_path;
+    uint64_t mtime;
+    uint64_t size;
+    uint32_t old_id;    /* id in the previous index, if unchanged since */
+} index_entry_t;
+
+/* Growable array of (trigram << 32 | file id) pairs */
+typedef struct pair_list {
+    uint64_t *pairs;
+    size_t count;
+    size_t capacity;
+} pair_list_t;
+
+
+void index_path(char *path, size_t pathsize, char *dir) {
+    size_t len = strlen(dir);
+    snprintf(path, pathsize, "%s%s%s", dir,
+             (len != 0 && dir[len - 1] == '/') ? "" : "/", INDEX_FILENAME);
+}
+
+
+/* Returns the path of a file beneath dir relative to dir */
+char *relative_path(char *dir, char *path) {
+    path += strlen(dir);
+    if (*path == '/')
+        path++;
+    return path;
+}
+
+
+uint64_t stat_mtime(struct stat *st) {
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+
+/* Returns nonzero if every path and posting list offset of the index lies
+ * within its section, and the last path is terminated, so that a corrupt or
+ * stale index cannot lead reads past the end of the mapping */
+int index_offsets_valid(index_t *index) {
+    uint32_t i;
+    if (index->header->file_count > 0 &&
+            (index->header->paths_size == 0 ||
+             index->paths[index->header->paths_size - 1] != '\0'))
+        return 0;
+    for (i = 0; i < index->header->file_count; i++) {
+        if (index->files[i].path_offset >= index->header->paths_size)
+            return 0;
+    }
+    for (i = 0; i < index->header->trigram_count; i++) {
+        if (index->trigrams[i].postings_offset > index->header->postings_size)
+            return 0;
+    }
+    return 1;
+}
+
+
+/* Maps the index of dir, returning 0 on success or -1 if there is no valid
+ * index */
+int open_index(char *dir, index_t *index) {
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+    size_t tables_size;
+    index_path(path, sizeof(path), dir);
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(index_header_t)) {
+        close(fd);
+        return -1;
+    }
+    index->size = st.st_size;
+    index->block = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index->block == MAP_FAILED)
+        return -1;
+    index->header = (index_header_t *)index->block;
+    tables_size = sizeof(index_file_t) * index->header->file_count +
+                  sizeof(index_trigram_t) * index->header->trigram_count;
+    if (memcmp(index->header->magic, INDEX_MAGIC, sizeof(index->header->magic)) != 0 ||
+            index->header->version != INDEX_FORMAT_VERSION ||
+            sizeof(index_header_t) + tables_size + index->header->paths_size +
+                index->header->postings_size != index->size) {
+        munmap(index->block, index->size);
+        return -1;
+    }
+    index->files = (index_file_t *)(index->header + 1);
+    index->trigrams = (index_trigram_t *)(index->files + index->header->file_count);
+    index->paths = (char *)(index->trigrams + index->header->trigram_count);
+    index->postings = (unsigned char *)(index->paths + index->header->paths_size);
+    if (!index_offsets_valid(index)) {
+        munmap(index->block, index->size);
+        return -1;
+    }
+    return 0;
+}
+
+
+void close_index(index_t *index) {
+    munmap(index->block, index->size);
+}
+
+
+/* Returns the id of the file with the given relative path, or NO_FILE */
+uint32_t find_indexed_file(index_t *index, char *rel_path) {
+    uint32_t lo = 0, hi = index->header->file_count, mid;
+    int cmp;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp(rel_path, index->paths + index->files[mid].path_offset);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NO_FILE;
+}
+
+
+index_trigram_t *find_trigram(index_t *index, uint32_t trigram) {
+    uint32_t lo = 0, hi = index->header->trigram_count, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index->trigrams[mid].trigram == trigram)
+            return index->trigrams + mid;
+        if (index->trigrams[mid].trigram > trigram)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+
+/* Decodes the next file id of a posting list, advancing *postings, which
+ * is never moved past end */
+uint32_t next_posting(unsigned char **postings, unsigned char *end, uint32_t prev_id) {
+    uint32_t delta = 0;
+    int shift = 0;
+    while (*postings < end && (**postings & 0x80)) {
+        if (shift < 32)
+            delta |= (uint32_t)(**postings & 0x7F) << shift;
+        shift += 7;
+        (*postings)++;
+    }
+    if (*postings < end) {
+        if (shift < 32)
+            delta |= (uint32_t)**postings << shift;
+        (*postings)++;
+    }
+    return prev_id + delta;
+}
+
+
+void write_varint(FILE *outfile, uint32_t value) {
+    while (value >= 0x80) {
+        fputc((value & 0x7F) | 0x80, outfile);
+        value >>= 7;
+    }
+    fputc(value, outfile);
+}
+
+
+size_t varint_size(uint32_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+
+void push_pair(pair_list_t *list, uint32_t trigram, uint32_t file_id) {
+    if (list->count == list->capacity) {
+        list->capacity = (list->capacity == 0) ? 4096 : list->capacity << 1;
+        list->pairs = realloc(list->pairs, sizeof(uint64_t) * list->capacity);
+    }
+    list->pairs[list->count++] = ((uint64_t)trigram << 32) | file_id;
+}
+
+
+/* Returns the value stored in the posting list for pairs[j]: the file id if
+ * it is the first pair for its trigram, or otherwise the difference from
+ * the previous file id */
+uint32_t posting_delta(uint64_t *pairs, size_t j) {
+    if (j == 0 || (pairs[j] >> 32) != (pairs[j - 1] >> 32))
+        return (uint32_t)pairs[j];
+    return (uint32_t)pairs[j] - (uint32_t)pairs[j - 1];
+}
+
+
+int compare_pairs(const void *a, const void *b) {
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+int compare_entries(const void *a, const void *b) {
+    return strcmp(((index_entry_t *)a)->rel_path, ((index_entry_t *)b)->rel_path);
+}
+
+
+/* Adds a pair for every distinct trigram in the file. The bitmap of seen
+ * trigrams is shared between files, and only the bits set by this file are
+ * cleared afterward, rather than the whole bitmap. */
+void scan_trigrams(char *path, uint32_t file_id, unsigned char *seen,
+                   pair_list_t *pairs) {
+    unsigned char buf[INDEX_BLOCK_SIZE];
+    uint32_t trigram = 0;
+    size_t first = pairs->count, i, total = 0;
+    ssize_t bytes_read;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return;
+    while ((bytes_read = read(fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < (size_t)bytes_read; i++, total++) {
+            trigram = ((trigram << 8) | FOLD(buf[i])) & (TRIGRAM_SPACE - 1);
+            if (total < 2 || (seen[trigram >> 3] & (1 << (trigram & 7))))
+                continue;
+            seen[trigram >> 3] |= 1 << (trigram & 7);
+            push_pair(pairs, trigram, file_id);
+        }
+    }
+    close(fd);
+    for (i = first; i < pairs->count; i++) {
+        trigram = pairs->pairs[i] >> 32;
+        seen[trigram >> 3] &= ~(1 << (trigram & 7));
+    }
+}
+
+
+/* Builds or updates the trigram index of every file beneath dir, stored in
+ * dir/INDEX_FILENAME. Files whose size and modification time are unchanged
+ * since the previous index keep their trigrams from it, and are not read.
+ * Returns 0 on success, or -1 on failure. */
+int build_index(char *dir) {
+    char path[PATH_MAX], tmp_path[PATH_MAX], *rel_path;
+    struct filepath_node *filepaths, *curr_fp;
+    index_t old_index;
+    int have_old_index;
+    index_entry_t *entries = NULL;
+    uint32_t entry_count = 0, entry_capacity = 0, *old_to_new = NULL, id, old_id, i;
+    uint32_t trigram_count = 0, posting_count;
+    pair_list_t pairs = {NULL, 0, 0};
+    unsigned char *seen, *postings, *postings_end;
+    uint64_t paths_size = 0, postings_size = 0;
+    size_t j, k;
+    index_header_t header;
+    index_file_t file;
+    index_trigram_t trigram;
+    struct stat st;
+    FILE *outfile;
+    int fd;
+    filepaths = build_recursive_filepaths_list(dir, NULL, stderr);
+    for (curr_fp = filepaths; curr_fp != NULL; curr_fp = curr_fp->next) {
+        rel_path = relative_path(dir, curr_fp->path);
+        if (strncmp(rel_path, INDEX_FILENAME, strlen(INDEX_FILENAME)) == 0)
+            continue;   /* the index itself, or a partially written one */
+        if (stat(curr_fp->path, &st) == -1 || !S_ISREG(st.st_mode))
+            continue;
+        if (entry_count == entry_capacity) {
+            entry_capacity = (entry_capacity == 0) ? 256 : entry_capacity << 1;
+            entries = realloc(entries, sizeof(index_entry_t) * entry_capacity);
+        }
+        entries[entry_count].rel_path = rel_path;
+        entries[entry_count].mtime = stat_mtime(&st);
+        entries[entry_count].size = st.st_size;
+        entries[entry_count].old_id = NO_FILE;
+        entry_count++;
+    }
+    qsort(entries, entry_count, sizeof(index_entry_t), compare_entries);
+    /* Carry over the trigrams of unchanged files from the previous index */
+    have_old_index = (open_index(dir, &old_index) == 0);
+    if (have_old_index) {
+        old_to_new = malloc(sizeof(uint32_t) * (old_index.header->file_count + 1));
+        for (i = 0; i < old_index.header->file_count; i++)
+            old_to_new[i] = NO_FILE;
+        for (id = 0; id < entry_count; id++) {
+            old_id = find_indexed_file(&old_index, entries[id].rel_path);
+            if (old_id != NO_FILE &&
+                    old_index.files[old_id].mtime == entries[id].mtime &&
+                    old_index.files[old_id].size == entries[id].size) {
+                entries[id].old_id = old_id;
+                old_to_new[old_id] = id;
+            }
+        }
+        for (i = 0; i < old_index.header->trigram_count; i++) {
+            postings = old_index.postings + old_index.trigrams[i].postings_offset;
+            postings_end = old_index.postings + old_index.header->postings_size;
+            for (old_id = 0, posting_count = 0; postings < postings_end &&
+                    posting_count < old_index.trigrams[i].posting_count; posting_count++) {
+                old_id = next_posting(&postings, postings_end, old_id);
+                if (old_id < old_index.header->file_count && old_to_new[old_id] != NO_FILE)
+                    push_pair(&pairs, old_index.trigrams[i].trigram, old_to_new[old_id]);
+            }
+        }
+        close_index(&old_index);
+        free(old_to_new);
+    }
+    /* Read only the files which are new or have changed */
+    seen = calloc(TRIGRAM_SPACE / 8, sizeof(unsigned char));
+    for (id = 0; id < entry_count; id++) {
+        if (entries[id].old_id == NO_FILE) {
+            snprintf(path, sizeof(path), "%s%s%s", dir,
+                     (dir[strlen(dir) - 1] == '/') ? "" : "/", entries[id].rel_path);
+            scan_trigrams(path, id, seen, &pairs);
+        }
+    }
+    free(seen);
+    qsort(pairs.pairs, pairs.count, sizeof(uint64_t), compare_pairs);
+    for (id = 0; id < entry_count; id++)
+        paths_size += strlen(entries[id].rel_path) + 1;
+    for (j = 0; j < pairs.count; j++) {
+        if (j == 0 || (pairs.pairs[j] >> 32) != (pairs.pairs[j - 1] >> 32))
+            trigram_count++;
+        postings_size += varint_size(posting_delta(pairs.pairs, j));
+    }
+    /* Write the new index beside the old one, then replace it */
+    index_path(path, sizeof(path), dir);
+    fd = -1;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= (int)sizeof(tmp_path) ||
+            (fd = mkstemp(tmp_path)) == -1 || (outfile = fdopen(fd, "w")) == NULL) {
+        fprintf(stderr, "ERROR: could not write index: %s\n", path);
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        cleanup_filepaths(filepaths);
+        free(entries);
+        free(pairs.pairs);
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_FORMAT_VERSION;
+    header.file_count = entry_count;
+    header.trigram_count = trigram_count;
+    header.paths_size = paths_size;
+    header.postings_size = postings_size;
+    fwrite(&header, sizeof(header), 1, outfile);
+    for (id = 0, file.path_offset = 0; id < entry_count; id++) {
+        file.mtime = entries[id].mtime;
+        file.size = entries[id].size;
+        fwrite(&file, sizeof(file), 1, outfile);
+        file.path_offset += strlen(entries[id].rel_path) + 1;
+    }
+    trigram.postings_offset = 0;
+    for (j = 0; j < pairs.count; j = k) {
+        trigram.trigram = pairs.pairs[j] >> 32;
+        trigram.posting_count = 0;
+        for (k = j; k < pairs.count && (pairs.pairs[k] >> 32) == trigram.trigram; k++)
+            trigram.posting_count++;
+        fwrite(&trigram, sizeof(trigram), 1, outfile);
+        for (; j < k; j++)
+            trigram.postings_offset += varint_size(posting_delta(pairs.pairs, j));
+    }
+    for (id = 0; id < entry_count; id++)
+        fwrite(entries[id].rel_path, sizeof(char), strlen(entries[id].rel_path) + 1, outfile);
+    for (j = 0; j < pairs.count; j++)
+        write_varint(outfile, posting_delta(pairs.pairs, j));
+    cleanup_filepaths(filepaths);   /* entries point into the paths */
+    free(entries);
+    free(pairs.pairs);
+    if (ferror(outfile)) {
+        fclose(outfile);
+        unlink(tmp_path);
+        fprintf(stderr, "ERROR: could not write index: %s\n", path);
+        return -1;
+    }
+    if (fclose(outfile) != 0 || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        fprintf(stderr, "ERROR: could not write index: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Removes from the list the files beneath dir which the index of dir shows
+ * cannot match, since they lack a trigram of a string which every match of
+ * the nfa contains, along with the index itself. Files which are not in the
+ * index, or have changed since it was built, are always kept. Returns the
+ * new head of the list. */
+struct filepath_node *filter_filepaths_by_index(char *dir, struct filepath_node *filepaths, nfa_t *nfa) {
+    index_t index;
+    char *literals, *literal, *rel_path;
+    unsigned char *candidates, *has_trigram, *postings, *postings_end;
+    struct filepath_node **curr_fp, *tmp;
+    uint32_t file_count, trigram, id, n;
+    index_trigram_t *entry;
+    struct stat st;
+    size_t i, len;
+    int filtered = 0;
+    if (open_index(dir, &index) != 0)
+        return filepaths;
+    file_count = index.header->file_count;
+    candidates = malloc(sizeof(unsigned char) * (file_count + 1));
+    has_trigram = malloc(sizeof(unsigned char) * (file_count + 1));
+    memset(candidates, 1, file_count);
+    literals = required_literals(nfa);
+    for (literal = literals; *literal != '\0'; literal += len + 1) {
+        len = strlen(literal);
+        for (i = 2; i < len; i++) {
+            trigram = (FOLD((unsigned char)literal[i - 2]) << 16) |
+                      (FOLD((unsigned char)literal[i - 1]) << 8) |
+                      FOLD((unsigned char)literal[i]);
+            memset(has_trigram, 0, file_count);
+            if ((entry = find_trigram(&index, trigram)) != NULL) {
+                postings = index.postings + entry->postings_offset;
+                postings_end = index.postings + index.header->postings_size;
+                for (id = 0, n = 0; postings < postings_end && n < entry->posting_count; n++) {
+                    id = next_posting(&postings, postings_end, id);
+                    if (id < file_count)
+                        has_trigram[id] = 1;
+                }
+            }
+            for (id = 0; id < file_count; id++)
+                candidates[id] &= has_trigram[id];
+            filtered = 1;
+        }
+    }
+    free(literals);
+    free(has_trigram);
+    for (curr_fp = &filepaths; *curr_fp != NULL; ) {
+        rel_path = relative_path(dir, (*curr_fp)->path);
+        id = find_indexed_file(&index, rel_path);
+        if (strcmp(rel_path, INDEX_FILENAME) == 0 ||
+                (filtered && id != NO_FILE && !candidates[id] &&
+                 stat((*curr_fp)->path, &st) == 0 &&
+                 index.files[id].mtime == stat_mtime(&st) &&
+                 index.files[id].size == (uint64_t)st.st_size)) {
+            tmp = *curr_fp;
+            *curr_fp = tmp->next;
+            free(tmp->path);
+            free(tmp);
+        } else {
+            curr_fp = &(*curr_fp)->next;
+        }
+    }
+    free(candidates);
+    close_index(&index);
+    return filepaths;
+}
@@ -1,15 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <assert.h>
 #include <pthread.h>
 
 #include "include/nfa.h"
+#include "include/cache.h"
+#include "include/utf8.h"
 
 
 static state_t *state_list = NULL;
 
 static int state_count = 0;
 
+static int counter_count = 0;
+
+/* Where invalid expressions are reported, or NULL for stderr */
+static FILE *build_errfile = NULL;
+
+#define BUILD_ERRFILE   ((build_errfile != NULL) ? build_errfile : stderr)
+
+
+/* Sets where build_nfa() reports invalid expressions, or NULL for stderr */
+void set_build_errfile(FILE *errfile) {
+    build_errfile = errfile;
+}
+
 
 state_t *create_state() {
     state_t *new = malloc(sizeof(state_t));
@@ -20,6 +39,7 @@ state_t *create_state() {
     state_list = new;
     new->prev = NULL;
     new->id = state_count;
+    new->pattern_id = -1;
     state_count++;
     return new;
 }
@@ -33,6 +53,9 @@ void add_transition(transition_t **transition_list,
     new->next_state = next_state;
     new->next = *transition_list;
     new->prev = NULL;
+    new->class_bitmap = NULL;
+    new->counter_id = -1;
+    new->repeat_count = 0;
     new->symbol = symbol;
     new->flags = flags;
     if (*transition_list != NULL)
@@ -41,19 +64,412 @@ void add_transition(transition_t **transition_list,
 }
 
 
-nfa_t *build_nfa(char *expression, int case_insensitive) {
-    state_t *cur_state, *prev_state = NULL;
+void add_class_transition(transition_t **transition_list,
+                          unsigned char *class_bitmap,
+                          state_t *next_state) {
+    /* Allocate the bitmap in the same block as the transition, so that it is
+     * freed along with it and stays adjacent to it in memory. */
+    transition_t *new = malloc(sizeof(transition_t) + CLASS_BITMAP_BYTES);
+    new->next_state = next_state;
+    new->next = *transition_list;
+    new->prev = NULL;
+    new->class_bitmap = (unsigned char *)(new + 1);
+    memcpy(new->class_bitmap, class_bitmap, CLASS_BITMAP_BYTES);
+    new->counter_id = -1;
+    new->repeat_count = 0;
+    new->symbol = '\0';
+    new->flags = FLAG_CLASS;
+    if (*transition_list != NULL)
+        (*transition_list)->prev = new;
+    *transition_list = new;
+}
+
+
+void add_counter_transition(transition_t **transition_list,
+                            t_flag_t flags,
+                            int counter_id,
+                            unsigned int repeat_count,
+                            state_t *next_state) {
+    add_transition(transition_list, '\0', flags, next_state);
+    (*transition_list)->counter_id = counter_id;
+    (*transition_list)->repeat_count = repeat_count;
+}
+
+
+void copy_transition(transition_t **transition_list, transition_t *transition) {
+    switch (transition->flags) {
+    case FLAG_CLASS:
+        add_class_transition(transition_list,
+                transition->class_bitmap,
+                transition->next_state);
+        break;
+    case FLAG_COUNT_LOOP:
+    case FLAG_COUNT_EXIT:
+        add_counter_transition(transition_list,
+                transition->flags,
+                transition->counter_id,
+                transition->repeat_count,
+                transition->next_state);
+        break;
+    default:
+        add_transition(transition_list,
+                transition->symbol,
+                transition->flags,
+                transition->next_state);
+    }
+}
+
+
+/* Copies the transitions which begin the most recent symbol or subexpression
+ * (which leads from prev_state to cur_state) onto the given transition list,
+ * so that the list's state can start another occurrence of it. If the most
+ * recent item was a subexpression, cur_state is the accept state of sub_nfa,
+ * and its first transitions are those of sub_nfa->q0. Otherwise, the symbol
+ * is the only non-epsilon transition from prev_state to the new cur_state.
+ * An epsilon transition from prev_state to cur_state, left by a ?, is copied
+ * too, so that each occurrence stays optional, unless the list is that of
+ * cur_state itself, where it would only lead back to the same state. */
+void copy_repeated_transitions(transition_t **transition_list,
+                               state_t *prev_state,
+                               state_t *cur_state,
+                               nfa_t *sub_nfa) {
     transition_t *cur_transition;
-    nfa_t *sub_nfa, *nfa = malloc(sizeof(nfa_t));
+    int subexpression = (sub_nfa != NULL && cur_state == sub_nfa->qaccept);
+    if (subexpression) {
+        for (cur_transition = sub_nfa->q0->transitions; cur_transition != NULL;
+                cur_transition = cur_transition->next)
+            copy_transition(transition_list, cur_transition);
+    }
+    for (cur_transition = prev_state->transitions; cur_transition != NULL;
+            cur_transition = cur_transition->next) {
+        if (cur_transition->next_state != cur_state)
+            continue;
+        if (IS_EPSILON(cur_transition->flags)) {
+            if (transition_list != &cur_state->transitions)
+                copy_transition(transition_list, cur_transition);
+        } else if (!subexpression) {
+            copy_transition(transition_list, cur_transition);
+        }
+    }
+}
+
+
+/* Reads a single symbol of a bracket expression, handling backslash escapes.
+ * Returns the number of characters consumed, or 0 if the expression ended. */
+size_t parse_class_symbol(char *expression, char *symbol) {
+    if (expression[0] == '\0')
+        return 0;
+    if (expression[0] != '\\') {
+        *symbol = expression[0];
+        return 1;
+    }
+    switch (expression[1]) {
+    case '\0':
+        return 0;
+    case 't':
+        *symbol = '\t';
+        break;
+    default:
+        *symbol = expression[1];
+    }
+    return 2;
+}
+
+
+/* Compiles the bracket expression beginning at expression[0] == '[' into
+ * the given bitmap. Supports ranges such as a-z, negation by a leading ^,
+ * and a literal ] or - as the first symbol. Case folding is applied here,
+ * so that matching never needs to consider it. Returns the number of
+ * characters consumed, including both brackets, or 0 on error. */
+size_t parse_class(char *expression, unsigned char *bitmap,
+                   int negate, int case_insensitive) {
+    size_t len = 1, consumed;
+    char lo, hi;
+    int c;
+    memset(bitmap, 0, CLASS_BITMAP_BYTES);
+    if (expression[len] == '^') {
+        negate = !negate;
+        len++;
+    }
+    if (expression[len] == ']') {
+        /* a ] immediately after the opening bracket is a literal */
+        CLASS_SET(bitmap, ']');
+        len++;
+    }
+    while (expression[len] != ']') {
+        if ((consumed = parse_class_symbol(expression + len, &lo)) == 0)
+            goto UNCLOSED_BRACKET;
+        len += consumed;
+        hi = lo;
+        if (expression[len] == '-' && expression[len + 1] != ']') {
+            len++;
+            if ((consumed = parse_class_symbol(expression + len, &hi)) == 0)
+                goto UNCLOSED_BRACKET;
+            len += consumed;
+            if ((unsigned char)hi < (unsigned char)lo) {
+                fprintf(BUILD_ERRFILE, "ERROR: invalid range %c-%c in expression: %s\n",
+                        lo, hi, expression);
+                return 0;
+            }
+        }
+        for (c = (unsigned char)lo; c <= (unsigned char)hi; c++)
+            CLASS_SET(bitmap, c);
+    }
+    len++;  /* consume the closing bracket */
+    if (case_insensitive) {
+        for (c = 0x41; c <= 0x5A; c++) {
+            if (CLASS_HAS(bitmap, c) || CLASS_HAS(bitmap, c | 0x20)) {
+                CLASS_SET(bitmap, c);
+                CLASS_SET(bitmap, c | 0x20);
+            }
+        }
+    }
+    if (negate) {
+        for (c = 0; c < CLASS_BITMAP_BYTES; c++)
+            bitmap[c] = ~bitmap[c];
+    }
+    CLASS_CLEAR(bitmap, '\0');  /* never match the end of the buffer */
+    return len;
+UNCLOSED_BRACKET:
+    fprintf(BUILD_ERRFILE, "ERROR: unclosed bracket in expression: %s\n", expression);
+    return 0;
+}
+
+
+/* Reads a single code point of a bracket expression in UTF-8 mode, handling
+ * backslash escapes. Returns the number of characters consumed, or 0 if the
+ * expression ended or is not valid UTF-8. */
+size_t parse_class_codepoint(char *expression, uint32_t *codepoint) {
+    size_t escape = 0, len;
+    if (expression[0] == '\\') {
+        if (expression[1] == 't') {
+            *codepoint = '\t';
+            return 2;
+        }
+        escape = 1;
+    }
+    if (expression[escape] == '\0' || (len = utf8_decode(expression + escape, codepoint)) == 0)
+        return 0;
+    return escape + len;
+}
+
+
+/* Like parse_class(), but in UTF-8 mode, so that each member is a code
+ * point, and the class is compiled into the set of code points it matches
+ * rather than a bitmap. */
+size_t parse_utf8_class(char *expression, codepoint_set_t *set,
+                        int negate, int case_insensitive) {
+    size_t len = 1, consumed;
+    uint32_t lo, hi;
+    init_codepoint_set(set);
+    if (expression[len] == '^') {
+        negate = !negate;
+        len++;
+    }
+    if (expression[len] == ']') {
+        /* a ] immediately after the opening bracket is a literal */
+        add_codepoint_range(set, ']', ']');
+        len++;
+    }
+    while (expression[len] != ']') {
+        if ((consumed = parse_class_codepoint(expression + len, &lo)) == 0)
+            goto INVALID_CLASS;
+        len += consumed;
+        hi = lo;
+        if (expression[len] == '-' && expression[len + 1] != ']') {
+            len++;
+            if ((consumed = parse_class_codepoint(expression + len, &hi)) == 0)
+                goto INVALID_CLASS;
+            len += consumed;
+            if (hi < lo) {
+                fprintf(BUILD_ERRFILE, "ERROR: invalid range in expression: %s\n", expression);
+                free_codepoint_set(set);
+                return 0;
+            }
+        }
+        add_codepoint_range(set, lo, hi);
+    }
+    len++;  /* consume the closing bracket */
+    normalize_codepoint_set(set);
+    if (case_insensitive)
+        fold_codepoint_set(set);
+    if (negate)
+        negate_codepoint_set(set);
+    return len;
+INVALID_CLASS:
+    if (expression[len] == '\0' || (expression[len] == '\\' && expression[len + 1] == '\0'))
+        fprintf(BUILD_ERRFILE, "ERROR: unclosed bracket in expression: %s\n", expression);
+    else
+        fprintf(BUILD_ERRFILE, "ERROR: invalid UTF-8 in expression: %s\n", expression);
+    free_codepoint_set(set);
+    return 0;
+}
+
+
+/* Builds a sub-nfa which reads exactly one code point of the set, one byte
+ * at a time, so that matching needs no decoding. Each sequence of byte
+ * ranges encoding part of the set becomes a path of class transitions from
+ * q0 to qaccept. Trailing continuation bytes which may take any value share
+ * one chain of states, and all single byte code points share one
+ * transition. Returns NULL if the set is empty. */
+nfa_t *build_codepoint_nfa(codepoint_set_t *set) {
+    utf8_sequence_t *sequences;
+    state_t *tails[UTF8_MAX_BYTES], *from, *to;
+    unsigned char ascii[CLASS_BITMAP_BYTES], bitmap[CLASS_BITMAP_BYTES];
+    size_t sequence_count, i;
+    int j, k, tail_len, has_ascii = 0;
+    nfa_t *nfa;
+    if ((sequence_count = utf8_sequences(set, &sequences)) == 0)
+        return NULL;
+    nfa = malloc(sizeof(nfa_t));
+    nfa->q0 = create_state();
+    nfa->qaccept = create_state();
+    nfa->expr_len = 0;
+    nfa->storage = NFA_STORAGE_STATES;
+    nfa->image = NULL;
+    nfa->image_size = 0;
+    memset(tails, 0, sizeof(tails));
+    tails[0] = nfa->qaccept;
+    memset(ascii, 0, CLASS_BITMAP_BYTES);
+    for (i = 0; i < sequence_count; i++) {
+        if (sequences[i].len == 1) {
+            for (k = sequences[i].lo[0]; k <= sequences[i].hi[0]; k++)
+                CLASS_SET(ascii, k);
+            has_ascii = 1;
+            continue;
+        }
+        /* the bytes after the first which may be any continuation byte */
+        for (tail_len = 0; tail_len < sequences[i].len - 1; tail_len++) {
+            j = sequences[i].len - 1 - tail_len;
+            if (sequences[i].lo[j] != 0x80 || sequences[i].hi[j] != 0xBF)
+                break;
+        }
+        for (k = 1; k <= tail_len; k++) {
+            if (tails[k] == NULL) {
+                tails[k] = create_state();
+                memset(bitmap, 0, CLASS_BITMAP_BYTES);
+                for (j = 0x80; j <= 0xBF; j++)
+                    CLASS_SET(bitmap, j);
+                add_class_transition(&tails[k]->transitions, bitmap, tails[k - 1]);
+            }
+        }
+        from = nfa->q0;
+        for (j = 0; j < sequences[i].len - tail_len; j++) {
+            to = (j == sequences[i].len - tail_len - 1) ? tails[tail_len] : create_state();
+            memset(bitmap, 0, CLASS_BITMAP_BYTES);
+            for (k = sequences[i].lo[j]; k <= sequences[i].hi[j]; k++)
+                CLASS_SET(bitmap, k);
+            add_class_transition(&from->transitions, bitmap, to);
+            from = to;
+        }
+    }
+    if (has_ascii) {
+        CLASS_CLEAR(ascii, '\0');   /* never match the end of the buffer */
+        add_class_transition(&nfa->q0->transitions, ascii, nfa->qaccept);
+    }
+    free(sequences);
+    return nfa;
+}
+
+
+/* Builds a sub-nfa reading the len bytes of one multi-byte code point, so
+ * that a following *, ?, + or **n applies to the whole code point */
+nfa_t *build_sequence_nfa(char *bytes, size_t len) {
+    nfa_t *nfa = malloc(sizeof(nfa_t));
+    state_t *from;
+    size_t i;
+    nfa->q0 = create_state();
+    nfa->qaccept = create_state();
+    nfa->expr_len = 0;
+    nfa->storage = NFA_STORAGE_STATES;
+    nfa->image = NULL;
+    nfa->image_size = 0;
+    from = nfa->q0;
+    for (i = 0; i < len - 1; i++) {
+        add_transition(&from->transitions, bytes[i], FLAG_NONE, create_state());
+        from = from->transitions->next_state;
+    }
+    add_transition(&from->transitions, bytes[len - 1], FLAG_NONE, nfa->qaccept);
+    return nfa;
+}
+
+
+/* Builds a sub-nfa reading any one code point other than the given one,
+ * for the negation of a symbol, or for '.' if codepoint is '\0' */
+nfa_t *build_negated_codepoint_nfa(uint32_t codepoint, int case_insensitive) {
+    codepoint_set_t set;
+    nfa_t *sub_nfa;
+    init_codepoint_set(&set);
+    if (codepoint != '\0')
+        add_codepoint_range(&set, codepoint, codepoint);
+    if (case_insensitive)
+        fold_codepoint_set(&set);
+    negate_codepoint_set(&set);
+    sub_nfa = build_codepoint_nfa(&set);
+    free_codepoint_set(&set);
+    return sub_nfa;
+}
+
+
+/* Decodes the symbol at expression[pos] in UTF-8 mode. Returns its length,
+ * or 0 if it is not valid UTF-8. */
+size_t decode_expression_symbol(char *expression, size_t pos, uint32_t *codepoint) {
+    size_t len = utf8_decode(expression + pos, codepoint);
+    if (len == 0)
+        fprintf(BUILD_ERRFILE, "ERROR: invalid UTF-8 in expression: %s\n", expression);
+    return len;
+}
+
+
+/* Links the sub-nfa for a single symbol or subexpression after cur_state,
+ * as is done for a parenthesized subexpression, and returns its accept
+ * state, which becomes the new cur_state */
+state_t *append_sub_nfa(state_t *cur_state, nfa_t *sub_nfa) {
+    transition_t *cur_transition;
+    for (cur_transition = sub_nfa->q0->transitions; cur_transition != NULL;
+            cur_transition = cur_transition->next)
+        copy_transition(&cur_state->transitions, cur_transition);
+    return sub_nfa->qaccept;
+}
+
+
+/* Identifies the nfa built from expression with the given flags, so that a
+ * search_buffer() generated for one expression can tell it apart from
+ * others */
+unsigned long long hash_expression(char *expression, int case_insensitive, int utf8) {
+    unsigned char flags = (case_insensitive != 0) | ((utf8 != 0) << 1);
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, &flags, sizeof(flags));
+    return fnv1a(hash, expression, strlen(expression));
+}
+
+
+nfa_t *build_nfa(char *expression, int case_insensitive, int utf8) {
+    state_t *cur_state, *prev_state = NULL, *loop_state, *repeat_exit = NULL;
+    transition_t *cur_transition;
+    unsigned char class_bitmap[CLASS_BITMAP_BYTES];
+    size_t class_len;
+    unsigned long repeat_count;
+    char *count_end;
+    codepoint_set_t class_set;
+    uint32_t codepoint;
+    size_t symbol_len;
+    nfa_t *sub_nfa = NULL, *nfa = malloc(sizeof(nfa_t));
     nfa->q0 = create_state();
     nfa->qaccept = create_state();
     nfa->expr_len = 0;
+    nfa->expression_hash = hash_expression(expression, case_insensitive, utf8);
+    nfa->storage = NFA_STORAGE_STATES;
+    nfa->image = NULL;
+    nfa->image_size = 0;
     cur_state = nfa->q0;
     while (1) {
         switch (expression[nfa->expr_len]) {
         case '(':
             nfa->expr_len++;    /* read from first char inside parens */
-            assert(expression[nfa->expr_len] != '\0');
+            if (expression[nfa->expr_len] == '\0') {
+                fprintf(BUILD_ERRFILE, "ERROR: unclosed parenthesis in expression: %s\n", expression);
+                return NULL;
+            }
             if (expression[nfa->expr_len] == ')') {
                 /* subexpression is (), which is meaningless. But other
                     * metachars *, ?, and + should have no effect when
@@ -69,7 +485,7 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
                     break;
                 }
             }
-            sub_nfa = build_nfa(expression + nfa->expr_len, case_insensitive);
+            sub_nfa = build_nfa(expression + nfa->expr_len, case_insensitive, utf8);
             if (sub_nfa == NULL)
                 /* missing closing paren in a subexpression of this one */
                 return NULL;
@@ -80,10 +496,7 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
                 * internal states which transition to sub_nfa->q0. */
             cur_transition = sub_nfa->q0->transitions;
             while (cur_transition != NULL) {
-                add_transition(&cur_state->transitions,
-                        cur_transition->symbol,
-                        cur_transition->flags,
-                        cur_transition->next_state);
+                copy_transition(&cur_state->transitions, cur_transition);
                 cur_transition = cur_transition->next;
             }
             prev_state = cur_state;
@@ -91,7 +504,7 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
             nfa->expr_len += sub_nfa->expr_len;
             if (expression[nfa->expr_len] != ')') {
                 /* missing closing paren */
-                fprintf(stderr, "ERROR: unclosed parenthesis in expression: %s\n", expression);
+                fprintf(BUILD_ERRFILE, "ERROR: unclosed parenthesis in expression: %s\n", expression);
                 return NULL;
             }
             break;
@@ -101,9 +514,13 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
                 * Otherwise, the expression "()" would match everything, and
                 * "...()*...", "...()?...", and "...()+..." would cause problems. */
             add_transition(&cur_state->transitions, '\0', FLAG_EPSILON, nfa->qaccept);
+            nfa->counter_count = counter_count;
+            nfa->state_count = state_count;
             return nfa;
         case '\0':
             add_transition(&cur_state->transitions, '\0', FLAG_EPSILON, nfa->qaccept);
+            nfa->counter_count = counter_count;
+            nfa->state_count = state_count;
             return nfa;
         case '|':
             if (cur_state == nfa->q0)
@@ -114,11 +531,80 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
             prev_state = NULL;
             break;
         case '.':
+            if (utf8) {
+                /* any one code point, however many bytes it takes */
+                sub_nfa = build_negated_codepoint_nfa('\0', 0);
+                prev_state = cur_state;
+                cur_state = append_sub_nfa(cur_state, sub_nfa);
+                break;
+            }
             prev_state = cur_state;
             cur_state = create_state();
             add_transition(&prev_state->transitions, '\0', FLAG_WILDCARD, cur_state);
             break;
+        case '[':
+            if (utf8) {
+                class_len = parse_utf8_class(expression + nfa->expr_len, &class_set,
+                                             0, case_insensitive);
+                if (class_len == 0)
+                    return NULL;
+                sub_nfa = build_codepoint_nfa(&class_set);
+                free_codepoint_set(&class_set);
+                if (sub_nfa == NULL) {
+                    fprintf(BUILD_ERRFILE, "ERROR: empty bracket expression in expression: %s\n", expression);
+                    return NULL;
+                }
+                prev_state = cur_state;
+                cur_state = append_sub_nfa(cur_state, sub_nfa);
+                nfa->expr_len += class_len - 1;
+                break;
+            }
+            class_len = parse_class(expression + nfa->expr_len, class_bitmap,
+                                    0, case_insensitive);
+            if (class_len == 0)
+                return NULL;
+            prev_state = cur_state;
+            cur_state = create_state();
+            add_class_transition(&prev_state->transitions, class_bitmap, cur_state);
+            nfa->expr_len += class_len - 1;  /* leave on the closing bracket */
+            break;
         case '*':
+            if (expression[nfa->expr_len + 1] == '*' &&
+                    expression[nfa->expr_len + 2] >= '0' &&
+                    expression[nfa->expr_len + 2] <= '9') {
+                /* **n, so match exactly n occurrences. Rather than making n
+                 * copies of the previous symbol or subexpression, loop back
+                 * to its start through a counted transition, and leave it
+                 * through another once the counter reaches n. Each thread
+                 * carries its own counters, so no states are duplicated. */
+                repeat_count = strtoul(expression + nfa->expr_len + 2, &count_end, 10);
+                if (prev_state == NULL || prev_state == cur_state ||
+                        cur_state == repeat_exit) {
+                    fprintf(BUILD_ERRFILE, "ERROR: nothing to repeat before **%lu in expression: %s\n",
+                            repeat_count, expression);
+                    return NULL;
+                }
+                if (repeat_count == 0 || repeat_count > UINT_MAX) {
+                    fprintf(BUILD_ERRFILE, "ERROR: invalid repetition count **%lu in expression: %s\n",
+                            repeat_count, expression);
+                    return NULL;
+                }
+                nfa->expr_len = count_end - expression - 1;    /* leave on last digit */
+                if (repeat_count == 1)
+                    break;
+                loop_state = create_state();
+                copy_repeated_transitions(&loop_state->transitions,
+                                          prev_state, cur_state, sub_nfa);
+                add_counter_transition(&cur_state->transitions, FLAG_COUNT_LOOP,
+                                       counter_count, repeat_count, loop_state);
+                repeat_exit = create_state();
+                add_counter_transition(&cur_state->transitions, FLAG_COUNT_EXIT,
+                                       counter_count, repeat_count, repeat_exit);
+                counter_count++;
+                cur_state = repeat_exit;
+                /* prev_state unchanged, so ? and * apply to the whole repetition */
+                break;
+            }
             if (prev_state == cur_state)
                 /* two * in a row, which is equivalent to one, so ignore the second */
                 break;
@@ -128,7 +614,10 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
             break;
         case '!':
             nfa->expr_len++;
-            assert(expression[nfa->expr_len] != '\0');
+            if (expression[nfa->expr_len] == '\0') {
+                fprintf(BUILD_ERRFILE, "ERROR: nothing to negate after ! in expression: %s\n", expression);
+                return NULL;
+            }
             switch (expression[nfa->expr_len]) {
             case '(':
             case ')':
@@ -136,18 +625,61 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
             case '*':
             case '?':
             case '+':
-                fprintf(stderr, "ERROR: Unexpected symbol '%c' following ! symbol\n",
+                fprintf(BUILD_ERRFILE, "ERROR: Unexpected symbol '%c' following ! symbol\n",
                         expression[nfa->expr_len]);
-                assert(0);
+                return NULL;
             case '!':
                 /* double negative: do nothing */
                 break;
             case '.':
                 /* !. would seem to imply no symbol, so ignore it */
                 break;
+            case '[':
+                /* ![...] is equivalent to [^...] */
+                if (utf8) {
+                    class_len = parse_utf8_class(expression + nfa->expr_len, &class_set,
+                                                 1, case_insensitive);
+                    if (class_len == 0)
+                        return NULL;
+                    sub_nfa = build_codepoint_nfa(&class_set);
+                    free_codepoint_set(&class_set);
+                    if (sub_nfa == NULL) {
+                        fprintf(BUILD_ERRFILE, "ERROR: empty bracket expression in expression: %s\n", expression);
+                        return NULL;
+                    }
+                    prev_state = cur_state;
+                    cur_state = append_sub_nfa(cur_state, sub_nfa);
+                    nfa->expr_len += class_len - 1;
+                    break;
+                }
+                class_len = parse_class(expression + nfa->expr_len, class_bitmap,
+                                        1, case_insensitive);
+                if (class_len == 0)
+                    return NULL;
+                prev_state = cur_state;
+                cur_state = create_state();
+                add_class_transition(&prev_state->transitions, class_bitmap, cur_state);
+                nfa->expr_len += class_len - 1;
+                break;
             case '\\':
                 nfa->expr_len++;
-                assert(expression[nfa->expr_len] != '\0');
+                if (expression[nfa->expr_len] == '\0') {
+                    fprintf(BUILD_ERRFILE, "ERROR: trailing backslash in expression: %s\n", expression);
+                    return NULL;
+                }
+                if (utf8) {
+                    if (expression[nfa->expr_len] == 't')
+                        codepoint = '\t';
+                    else if ((symbol_len = decode_expression_symbol(expression, nfa->expr_len,
+                                                                    &codepoint)) == 0)
+                        return NULL;
+                    else
+                        nfa->expr_len += symbol_len - 1;
+                    sub_nfa = build_negated_codepoint_nfa(codepoint, case_insensitive);
+                    prev_state = cur_state;
+                    cur_state = append_sub_nfa(cur_state, sub_nfa);
+                    break;
+                }
                 switch (expression[nfa->expr_len]) {
                 case 't':
                     prev_state = cur_state;
@@ -171,6 +703,17 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
                 }
                 break;
             default:
+                if (utf8) {
+                    /* any one code point other than the negated one */
+                    if ((symbol_len = decode_expression_symbol(expression, nfa->expr_len,
+                                                               &codepoint)) == 0)
+                        return NULL;
+                    sub_nfa = build_negated_codepoint_nfa(codepoint, case_insensitive);
+                    prev_state = cur_state;
+                    cur_state = append_sub_nfa(cur_state, sub_nfa);
+                    nfa->expr_len += symbol_len - 1;
+                    break;
+                }
                 prev_state = cur_state;
                 cur_state = create_state();
                 if (case_insensitive &&
@@ -186,6 +729,20 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
                 break;
             }
             break;
+        case '+':
+            if (prev_state == cur_state)
+                /* previous symbol was *, so this + is meaningless, so ignore it */
+                break;
+            if (prev_state == NULL || cur_state == repeat_exit) {
+                fprintf(BUILD_ERRFILE, "ERROR: nothing to repeat before + in expression: %s\n",
+                        expression);
+                return NULL;
+            }
+            /* ss* is equivalent to a loop which may restart s once s has
+             * been matched, so no copy of s or epsilon transition is needed */
+            copy_repeated_transitions(&cur_state->transitions,
+                                      prev_state, cur_state, sub_nfa);
+            break;
         case '?':
             if (prev_state == cur_state)
                 /* previous symbol was *, so this ? is meaningless, so ignore it */
@@ -194,7 +751,10 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
             break;
         case '\\':
             nfa->expr_len++;
-            assert(expression[nfa->expr_len] != '\0');
+            if (expression[nfa->expr_len] == '\0') {
+                fprintf(BUILD_ERRFILE, "ERROR: trailing backslash in expression: %s\n", expression);
+                return NULL;
+            }
             switch (expression[nfa->expr_len]) {
             case 't':
                 prev_state = cur_state;
@@ -202,6 +762,16 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
                 add_transition(&prev_state->transitions, '\t', FLAG_NONE, cur_state);
                 break;
             default:
+                if (utf8 && (unsigned char)expression[nfa->expr_len] >= 0x80) {
+                    if ((symbol_len = decode_expression_symbol(expression, nfa->expr_len,
+                                                               &codepoint)) == 0)
+                        return NULL;
+                    sub_nfa = build_sequence_nfa(expression + nfa->expr_len, symbol_len);
+                    prev_state = cur_state;
+                    cur_state = append_sub_nfa(cur_state, sub_nfa);
+                    nfa->expr_len += symbol_len - 1;
+                    break;
+                }
                 prev_state = cur_state;
                 cur_state = create_state();
                 if (case_insensitive &&
@@ -218,6 +788,18 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
             }
             break;
         default:
+            if (utf8 && (unsigned char)expression[nfa->expr_len] >= 0x80) {
+                /* a multi-byte code point, kept together so that a
+                 * following *, ?, + or **n repeats all of it */
+                if ((symbol_len = decode_expression_symbol(expression, nfa->expr_len,
+                                                           &codepoint)) == 0)
+                    return NULL;
+                sub_nfa = build_sequence_nfa(expression + nfa->expr_len, symbol_len);
+                prev_state = cur_state;
+                cur_state = append_sub_nfa(cur_state, sub_nfa);
+                nfa->expr_len += symbol_len - 1;
+                break;
+            }
             prev_state = cur_state;
             cur_state = create_state();
             if (case_insensitive &&
@@ -237,6 +819,43 @@ nfa_t *build_nfa(char *expression, int case_insensitive) {
 }
 
 
+/* Builds one nfa matching any of the given expressions, for finding which
+ * of them match in a single pass with find_patterns(). Each expression
+ * keeps its own accepting state, tagged with its index as pattern_id, and
+ * the start state takes a copy of every expression's first transitions.
+ * The nfa's own qaccept is unreachable. Returns NULL if any expression is
+ * invalid. */
+nfa_t *build_union_nfa(char **expressions, int expression_count, int case_insensitive,
+                       int utf8) {
+    nfa_t *sub_nfa, *nfa = malloc(sizeof(nfa_t));
+    transition_t *cur_transition;
+    int i;
+    nfa->q0 = create_state();
+    nfa->qaccept = create_state();
+    nfa->expr_len = 0;
+    nfa->expression_hash = 0;
+    nfa->storage = NFA_STORAGE_STATES;
+    nfa->image = NULL;
+    nfa->image_size = 0;
+    for (i = 0; i < expression_count; i++) {
+        if ((sub_nfa = build_nfa(expressions[i], case_insensitive, utf8)) == NULL) {
+            free(nfa);
+            return NULL;
+        }
+        sub_nfa->qaccept->pattern_id = i;
+        for (cur_transition = sub_nfa->q0->transitions; cur_transition != NULL;
+                cur_transition = cur_transition->next)
+            copy_transition(&nfa->q0->transitions, cur_transition);
+        nfa->expr_len += sub_nfa->expr_len;
+        /* its states stay in the state list, to be freed with the union */
+        free(sub_nfa);
+    }
+    nfa->counter_count = counter_count;
+    nfa->state_count = state_count;
+    return nfa;
+}
+
+
 void print_nfa(nfa_t *nfa, FILE *outfile) {
     transition_t *cur_t;
     state_t *cur_s = state_list;
@@ -261,12 +880,356 @@ void cleanup_states() {
         state_list = state_list->next;
         free(tmp_s);
     }
+    state_count = 0;
+    counter_count = 0;
 }
 
 
 void free_nfa(nfa_t *nfa) {
-    cleanup_states();
-    free(nfa);
+    switch (nfa->storage) {
+    case NFA_STORAGE_STATES:
+        cleanup_states();
+        free(nfa);
+        break;
+    case NFA_STORAGE_HEAP:
+        free(nfa->image);
+        break;
+    case NFA_STORAGE_MAPPED:
+        munmap(nfa->image, nfa->image_size);
+        break;
+    }
+}
+
+
+/* Returns the strings which must appear in every match of the nfa, so that
+ * input lacking any of them can be skipped without being searched. They are
+ * found from the dominators of the accept state: the states which every path
+ * from q0 to qaccept passes through. If every transition into a dominator
+ * reads the same literal symbol, that symbol must be read just before
+ * reaching it, and consecutive such dominators, each entered only from the
+ * previous one, give a required string. Symbols are lowercase if the nfa is
+ * case insensitive. The strings are returned in one allocated block, each
+ * terminated by '\0', with an empty string marking the end of the block. */
+char *required_literals(nfa_t *nfa) {
+    int n = nfa->state_count, words = (n + 31) / 32, changed, top = 0, i, j, u, v;
+    int dominator_count = 0, run_len = 0, prev_dominator = -1;
+    size_t len = 0;
+    state_t **states = calloc(n, sizeof(state_t *)), **stack = malloc(sizeof(state_t *) * n);
+    transition_t *cur_t;
+    unsigned int *dom = malloc(sizeof(unsigned int) * n * words);
+    unsigned int *acc = malloc(sizeof(unsigned int) * n * words);
+    int *in_symbol = malloc(sizeof(int) * n);   /* -1 if none, -2 if not one literal */
+    int *in_source = malloc(sizeof(int) * n);   /* -1 if none, -2 if multiple */
+    int *dominators = malloc(sizeof(int) * n), *depth = malloc(sizeof(int) * n);
+    char *literals = malloc(sizeof(char) * (2 * n + 2));
+#define DOM(id)     (dom + (id) * words)
+#define ACC(id)     (acc + (id) * words)
+#define HAS(set, id)    ((set)[(id) >> 5] & (1U << ((id) & 31)))
+    /* find the reachable states, and what enters each of them */
+    for (i = 0; i < n; i++) {
+        in_symbol[i] = -1;
+        in_source[i] = -1;
+    }
+    states[nfa->q0->id] = nfa->q0;
+    stack[top++] = nfa->q0;
+    while (top > 0) {
+        u = stack[--top]->id;
+        for (cur_t = states[u]->transitions; cur_t != NULL; cur_t = cur_t->next) {
+            v = cur_t->next_state->id;
+            if (cur_t->flags != FLAG_NONE ||
+                    (in_symbol[v] != -1 && in_symbol[v] != (unsigned char)cur_t->symbol))
+                in_symbol[v] = -2;
+            else if (in_symbol[v] == -1)
+                in_symbol[v] = (unsigned char)cur_t->symbol;
+            in_source[v] = (in_source[v] == -1 || in_source[v] == u) ? u : -2;
+            if (states[v] == NULL) {
+                states[v] = cur_t->next_state;
+                stack[top++] = cur_t->next_state;
+            }
+        }
+    }
+    /* iterate dom(v) = {v} + intersection of dom(u) over edges u->v */
+    for (i = 0; i < n * words; i++)
+        dom[i] = ~0U;
+    memset(DOM(nfa->q0->id), 0, sizeof(unsigned int) * words);
+    DOM(nfa->q0->id)[nfa->q0->id >> 5] |= 1U << (nfa->q0->id & 31);
+    do {
+        changed = 0;
+        for (i = 0; i < n * words; i++)
+            acc[i] = ~0U;
+        for (u = 0; u < n; u++) {
+            if (states[u] == NULL)
+                continue;
+            for (cur_t = states[u]->transitions; cur_t != NULL; cur_t = cur_t->next)
+                for (v = cur_t->next_state->id, i = 0; i < words; i++)
+                    ACC(v)[i] &= DOM(u)[i];
+        }
+        for (v = 0; v < n; v++) {
+            if (states[v] == NULL || v == nfa->q0->id)
+                continue;
+            ACC(v)[v >> 5] |= 1U << (v & 31);
+            if (memcmp(ACC(v), DOM(v), sizeof(unsigned int) * words) != 0) {
+                memcpy(DOM(v), ACC(v), sizeof(unsigned int) * words);
+                changed = 1;
+            }
+        }
+    } while (changed);
+    /* the dominators of qaccept form a chain, ordered by their own number of
+     * dominators, so sort them into the order in which paths visit them */
+    if (states[nfa->qaccept->id] != NULL) {
+        for (v = 0; v < n; v++) {
+            if (!HAS(DOM(nfa->qaccept->id), v) || v == nfa->q0->id)
+                continue;
+            for (depth[v] = 0, i = 0; i < words; i++)
+                depth[v] += __builtin_popcount(DOM(v)[i]);
+            for (j = dominator_count++; j > 0 && depth[dominators[j - 1]] > depth[v]; j--)
+                dominators[j] = dominators[j - 1];
+            dominators[j] = v;
+        }
+    }
+    prev_dominator = nfa->q0->id;
+    for (i = 0; i < dominator_count; i++) {
+        v = dominators[i];
+        if (in_symbol[v] < 0 || (run_len != 0 && in_source[v] != prev_dominator)) {
+            /* the current run of required symbols ends here */
+            if (run_len != 0)
+                literals[len++] = '\0';
+            run_len = 0;
+        }
+        if (in_symbol[v] >= 0) {
+            literals[len++] = in_symbol[v];
+            run_len++;
+        }
+        prev_dominator = v;
+    }
+    if (run_len != 0)
+        literals[len++] = '\0';
+    literals[len] = '\0';
+#undef DOM
+#undef ACC
+#undef HAS
+    free(states);
+    free(stack);
+    free(dom);
+    free(acc);
+    free(in_symbol);
+    free(in_source);
+    free(dominators);
+    free(depth);
+    return literals;
+}
+
+
+#define IMAGE_OFFSET(type, offset)  ((type)(uintptr_t)(offset))
+#define STATE_OFFSET(id)    (sizeof(nfa_image_header_t) + sizeof(state_t) * (id))
+#define TRANSITION_IMAGE_SIZE(t)    (sizeof(transition_t) + \
+        ((t)->flags == FLAG_CLASS ? CLASS_BITMAP_BYTES : 0))
+
+
+/* Flattens the most recently built nfa, whose states are those in the state
+ * list with ids 0 through state_count - 1, into a newly allocated image. See
+ * nfa_image_header_t for the layout. Returns the size of the image. */
+size_t flatten_nfa(nfa_t *nfa, char **image) {
+    nfa_image_header_t *header;
+    state_t *cur_s, *new_s;
+    transition_t *cur_t, *new_t, *prev_t;
+    size_t offset, prev_offset, size = STATE_OFFSET(state_count);
+    assert(nfa->storage == NFA_STORAGE_STATES);
+    for (cur_s = state_list; cur_s != NULL; cur_s = cur_s->next)
+        for (cur_t = cur_s->transitions; cur_t != NULL; cur_t = cur_t->next)
+            size += TRANSITION_IMAGE_SIZE(cur_t);
+    *image = calloc(1, size);
+    header = (nfa_image_header_t *)*image;
+    header->nfa = *nfa;
+    header->nfa.q0 = IMAGE_OFFSET(state_t *, STATE_OFFSET(nfa->q0->id));
+    header->nfa.qaccept = IMAGE_OFFSET(state_t *, STATE_OFFSET(nfa->qaccept->id));
+    header->nfa.image = NULL;
+    header->nfa.image_size = 0;
+    header->state_count = state_count;
+    offset = STATE_OFFSET(state_count);
+    for (cur_s = state_list; cur_s != NULL; cur_s = cur_s->next) {
+        new_s = (state_t *)(*image + STATE_OFFSET(cur_s->id));
+        new_s->id = cur_s->id;
+        new_s->pattern_id = cur_s->pattern_id;
+        new_s->next = NULL;     /* images are not part of the state list */
+        new_s->prev = NULL;
+        new_s->transitions = NULL;
+        prev_t = NULL;
+        prev_offset = 0;
+        for (cur_t = cur_s->transitions; cur_t != NULL; cur_t = cur_t->next) {
+            new_t = (transition_t *)(*image + offset);
+            *new_t = *cur_t;
+            new_t->next_state = IMAGE_OFFSET(state_t *, STATE_OFFSET(cur_t->next_state->id));
+            new_t->next = NULL;
+            new_t->prev = IMAGE_OFFSET(transition_t *, prev_offset);
+            if (cur_t->flags == FLAG_CLASS) {
+                memcpy(new_t + 1, cur_t->class_bitmap, CLASS_BITMAP_BYTES);
+                new_t->class_bitmap = IMAGE_OFFSET(unsigned char *, offset + sizeof(transition_t));
+            }
+            if (prev_t == NULL)
+                new_s->transitions = IMAGE_OFFSET(transition_t *, offset);
+            else
+                prev_t->next = IMAGE_OFFSET(transition_t *, offset);
+            prev_t = new_t;
+            prev_offset = offset;
+            offset += TRANSITION_IMAGE_SIZE(cur_t);
+        }
+    }
+    return size;
+}
+
+
+/* Converts a stored offset back into a pointer into the image, failing if
+ * the offset lies outside of it. NULL is stored as 0, which is never the
+ * offset of a state or transition, since the header is stored there. */
+#define RELOCATE(ptr, type) do { \
+        if ((uintptr_t)(ptr) >= image_size) \
+            return NULL; \
+        if ((ptr) != NULL) \
+            (ptr) = (type)(image + (uintptr_t)(ptr)); \
+    } while (0)
+
+
+/* Makes a flattened image usable in place by converting every stored offset
+ * into a pointer. The image lives within block, which is freed or unmapped
+ * according to storage by free_nfa(). Returns NULL if the image is invalid,
+ * in which case the caller remains responsible for block. */
+nfa_t *relocate_nfa(char *image, size_t image_size, nfa_storage_t storage,
+                    void *block, size_t block_size) {
+    nfa_image_header_t *header = (nfa_image_header_t *)image;
+    state_t *cur_s;
+    transition_t *cur_t;
+    size_t i;
+    if (image_size < sizeof(nfa_image_header_t) ||
+            header->state_count > (image_size - sizeof(nfa_image_header_t)) / sizeof(state_t))
+        return NULL;
+    RELOCATE(header->nfa.q0, state_t *);
+    RELOCATE(header->nfa.qaccept, state_t *);
+    for (i = 0; i < header->state_count; i++) {
+        cur_s = (state_t *)(image + STATE_OFFSET(i));
+        RELOCATE(cur_s->transitions, transition_t *);
+        for (cur_t = cur_s->transitions; cur_t != NULL; cur_t = cur_t->next) {
+            if ((char *)cur_t + sizeof(transition_t) > image + image_size)
+                return NULL;
+            RELOCATE(cur_t->next_state, state_t *);
+            RELOCATE(cur_t->next, transition_t *);
+            RELOCATE(cur_t->prev, transition_t *);
+            RELOCATE(cur_t->class_bitmap, unsigned char *);
+            if (cur_t->class_bitmap != NULL &&
+                    cur_t->class_bitmap + CLASS_BITMAP_BYTES > (unsigned char *)image + image_size)
+                return NULL;
+        }
+    }
+    header->nfa.storage = storage;
+    header->nfa.image = block;
+    header->nfa.image_size = block_size;
+    return &header->nfa;
+}
+
+
+/* Returns nonzero if the symbol-consuming transition accepts the symbol c,
+ * which has already been case folded if necessary. */
+int symbol_matches(transition_t *transition, char c) {
+    switch (transition->flags) {
+    case FLAG_EPSILON:
+    case FLAG_COUNT_LOOP:
+    case FLAG_COUNT_EXIT:
+        return 0;
+    case FLAG_WILDCARD:
+        return 1;
+    case FLAG_INVERT:
+        return c != transition->symbol;
+    case FLAG_CLASS:
+        return CLASS_HAS(transition->class_bitmap, c);
+    default:
+        return c == transition->symbol;
+    }
+}
+
+
+/* Returns nonzero if a match may begin with the symbol c. Any state which q0
+ * reaches without reading a symbol, as after "x?" or an empty alternative,
+ * may begin one too, so such a start is never ruled out here. */
+int may_start_match(state_t *q0, char c) {
+    transition_t *cur_transition;
+    for (cur_transition = q0->transitions; cur_transition != NULL;
+            cur_transition = cur_transition->next) {
+        if (IS_EPSILON(cur_transition->flags) || symbol_matches(cur_transition, c))
+            return 1;
+    }
+    return 0;
+}
+
+
+/* Returns nonzero if the transition may be taken on the symbol c, given the
+ * repetition counters of the thread considering it. */
+int transition_viable(transition_t *transition, char c, unsigned int *counters) {
+    switch (transition->flags) {
+    case FLAG_EPSILON:
+        return 1;
+    case FLAG_COUNT_LOOP:
+        return counters[transition->counter_id] + 1 < transition->repeat_count;
+    case FLAG_COUNT_EXIT:
+        return counters[transition->counter_id] + 1 == transition->repeat_count;
+    default:
+        return c != '\0' && symbol_matches(transition, c);
+    }
+}
+
+
+/* Updates the repetition counters of a thread which takes the transition */
+void apply_counters(transition_t *transition, unsigned int *counters) {
+    switch (transition->flags) {
+    case FLAG_COUNT_LOOP:
+        counters[transition->counter_id]++;
+        break;
+    case FLAG_COUNT_EXIT:
+        /* reset, so that the repetition can be entered again later */
+        counters[transition->counter_id] = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+
+void *run_nfa(void *arg);
+
+
+void record_pattern_hit(pattern_hits_t *hits, int pattern_id) {
+    unsigned long stamp = hits->stamps[pattern_id];
+    if (stamp != hits->stamp &&
+            __sync_bool_compare_and_swap(&hits->stamps[pattern_id], stamp, hits->stamp))
+        hits->hits[__sync_fetch_and_add(&hits->hit_count, 1)] = pattern_id;
+}
+
+
+/* Forks a child thread which takes the given transition from position pos,
+ * and pushes it onto the list of threads. The child receives its own copy
+ * of the repetition counters, allocated in the same block as the list
+ * element, so that it may update them independently. */
+void fork_transition(pthread_list_ele_t **threads, nfa_arg_t *arg,
+                     transition_t *transition, size_t pos) {
+    pthread_list_ele_t *tmp = malloc(sizeof(pthread_list_ele_t) +
+                                     sizeof(unsigned int) * arg->counter_count);
+    tmp->next = *threads;
+    *threads = tmp;
+    tmp->arg.buf = arg->buf;
+    tmp->arg.bufsize = arg->bufsize;
+    tmp->arg.state = transition->next_state;
+    tmp->arg.qaccept = arg->qaccept;
+    tmp->arg.pos = pos + !IS_EPSILON(transition->flags);
+    tmp->arg.end = 0;
+    tmp->arg.case_insensitive = arg->case_insensitive;
+    tmp->arg.counter_count = arg->counter_count;
+    tmp->arg.counters = NULL;
+    tmp->arg.hits = arg->hits;
+    if (arg->counter_count != 0) {
+        tmp->arg.counters = (unsigned int *)(tmp + 1);
+        memcpy(tmp->arg.counters, arg->counters, sizeof(unsigned int) * arg->counter_count);
+        apply_counters(transition, tmp->arg.counters);
+    }
+    pthread_create(&tmp->thread, NULL, &run_nfa, &tmp->arg);
 }
 
 
@@ -276,11 +1239,13 @@ void *run_nfa(void *arg) {
     size_t pos = ((nfa_arg_t *)arg)->pos;
     transition_t *cur_t = ((nfa_arg_t *)arg)->state->transitions;
     pthread_list_ele_t *tmp, *threads = NULL;
-    size_t future_child_pos;
-    state_t *future_child_state = NULL;
+    transition_t *future_child_t = NULL;
     char c = ((nfa_arg_t *)arg)->buf[pos];
-    if (((nfa_arg_t *)arg)->state == ((nfa_arg_t *)arg)->qaccept) {
+    if (((nfa_arg_t *)arg)->state == ((nfa_arg_t *)arg)->qaccept ||
+            ((nfa_arg_t *)arg)->state->pattern_id >= 0) {
         ((nfa_arg_t *)arg)->end = pos;
+        if (((nfa_arg_t *)arg)->hits != NULL)
+            record_pattern_hit(((nfa_arg_t *)arg)->hits, ((nfa_arg_t *)arg)->state->pattern_id);
         return (void *)MATCH_FOUND;
     }
     if (pos == ((nfa_arg_t *)arg)->bufsize - 1)
@@ -288,54 +1253,28 @@ void *run_nfa(void *arg) {
     if (((nfa_arg_t *)arg)->case_insensitive && c >= 0x41 && c <= 0x5A)
         c |= 0x20;  /* transitions should already be case insensitive */
     while (cur_t != NULL) {   /* catch viable transitions, and fork on previous one */
-        if (cur_t->flags == FLAG_EPSILON || (c != '\0' &&
-                    (cur_t->flags == FLAG_WILDCARD ||
-                     (cur_t->flags == FLAG_INVERT ?
-                      c != cur_t->symbol :
-                      c == cur_t->symbol)))) {
-            if (future_child_state != NULL) {
-                tmp = malloc(sizeof(pthread_list_ele_t));
-                tmp->next = threads;
-                threads = tmp;
-                tmp->arg.buf = ((nfa_arg_t *)arg)->buf;
-                tmp->arg.bufsize = ((nfa_arg_t *)arg)->bufsize;
-                tmp->arg.state = future_child_state;
-                tmp->arg.qaccept = ((nfa_arg_t *)arg)->qaccept;
-                tmp->arg.pos = future_child_pos;
-                tmp->arg.end = 0;
-                tmp->arg.case_insensitive = ((nfa_arg_t *)arg)->case_insensitive;
-                pthread_create(&tmp->thread, NULL, &run_nfa, &tmp->arg);
-                //fprintf(stderr, "Forked thread on q%d->q%d: %c at position %d\n", ((nfa_arg_t *)arg)->state->id, future_child_state->id, ((nfa_arg_t *)arg)->buf[((nfa_arg_t *)arg)->pos], ((nfa_arg_t *)arg)->pos);
-            }
-            future_child_pos = pos + (cur_t->flags != FLAG_EPSILON);
-            future_child_state = cur_t->next_state;
+        if (transition_viable(cur_t, c, ((nfa_arg_t *)arg)->counters)) {
+            if (future_child_t != NULL)
+                fork_transition(&threads, (nfa_arg_t *)arg, future_child_t, pos);
+            future_child_t = cur_t;
         }
         cur_t = cur_t->next;
     }
-    if (future_child_state == NULL)
+    if (future_child_t == NULL)
         return (void *)MATCH_NONE;
     /* Now, all but most recent viable transition have been forked */
     if (threads == NULL) {
         /* There was only one viable transition, so do it yourself */
-        ((nfa_arg_t *)arg)->state = future_child_state;
-        ((nfa_arg_t *)arg)->pos = future_child_pos;
+        ((nfa_arg_t *)arg)->state = future_child_t->next_state;
+        ((nfa_arg_t *)arg)->pos = pos + !IS_EPSILON(future_child_t->flags);
+        if (((nfa_arg_t *)arg)->counters != NULL)
+            apply_counters(future_child_t, ((nfa_arg_t *)arg)->counters);
         match_status = (match_status_t)run_nfa(arg);
         ((nfa_arg_t *)arg)->pos = pos;
         return (void *)match_status;
     }
     /* There were multiple viable transitions, so fork the last one */
-    tmp = malloc(sizeof(pthread_list_ele_t));
-    tmp->next = threads;
-    threads = tmp;
-    tmp->arg.buf = ((nfa_arg_t *)arg)->buf;
-    tmp->arg.bufsize = ((nfa_arg_t *)arg)->bufsize;
-    tmp->arg.state = future_child_state;
-    tmp->arg.qaccept = ((nfa_arg_t *)arg)->qaccept;
-    tmp->arg.pos = future_child_pos;
-    tmp->arg.end = 0;
-    tmp->arg.case_insensitive = ((nfa_arg_t *)arg)->case_insensitive;
-    pthread_create(&tmp->thread, NULL, &run_nfa, &tmp->arg);
-    //fprintf(stderr, "Forked thread on q%d->q%d: %c at position %d\n", ((nfa_arg_t *)arg)->state->id, future_child_state->id, ((nfa_arg_t *)arg)->buf[((nfa_arg_t *)arg)->pos], ((nfa_arg_t *)arg)->pos);
+    fork_transition(&threads, (nfa_arg_t *)arg, future_child_t, pos);
     /* There were threads forked, so join them and take the best */
     while (threads != NULL) {
         pthread_join(threads->thread, &retval);
@@ -362,10 +1301,23 @@ void *run_nfa(void *arg) {
 }
 
 
+/* Weak, so that a search_buffer() generated by perg --emit-c for a single
+ * expression replaces this one when it is built in. The generated one falls
+ * back to search_buffer_nfa() for any other expression. */
+__attribute__((weak))
 match_status_t search_buffer(char *buf, size_t bufsize, nfa_t *nfa,
                              match_list_t *match_list,  int case_insensitive,
                              int match_full_words,      int match_full_lines,
                              int invert_match) {
+    return search_buffer_nfa(buf, bufsize, nfa, match_list, case_insensitive,
+                             match_full_words, match_full_lines, invert_match);
+}
+
+
+match_status_t search_buffer_nfa(char *buf, size_t bufsize, nfa_t *nfa,
+                                 match_list_t *match_list,  int case_insensitive,
+                                 int match_full_words,      int match_full_lines,
+                                 int invert_match) {
     /* Do _not_ overwrite match_list->head or ->tail or assume they are NULL,
      * since in text mode, if partial matches exist, they are preserved by
      * maintaining a position in the match list. */
@@ -374,36 +1326,30 @@ match_status_t search_buffer(char *buf, size_t bufsize, nfa_t *nfa,
     match_list_ele_t *new_match;
     void *retval;
     match_status_t match_status = MATCH_NONE;
-    transition_t *cur_transition;
+    int starts;
     char c;
     for (pos = 0; pos < bufsize && buf[pos] != '\0'; pos++) {
 TOP_OF_FOR_LOOP:
         c = buf[pos];
         if (case_insensitive && c >= 0x41 && c <= 0x5A)
             c |= 0x20;
-        cur_transition = nfa->q0->transitions;
-        while (cur_transition != NULL) {
-            if (cur_transition->flags == FLAG_WILDCARD ||
-                    (cur_transition->flags == FLAG_INVERT ?
-                     cur_transition->symbol != c :
-                     cur_transition->symbol == c))
-                break;
-            cur_transition = cur_transition->next;
-        }
-        if (match_full_lines && (cur_transition == NULL || match_list->head != NULL)) {
+        starts = may_start_match(nfa->q0, c);
+        if (match_full_lines && (!starts || match_list->head != NULL)) {
             /* No viable transition from first position, or the buffer isn't
              * actually the start of the line, so don't count any matches */
             /* TODO figure out what to do about previous partial matches and preserved buffers */
             return (invert_match ? MATCH_FOUND : MATCH_NONE);
         }
-        if (cur_transition == NULL) {
+        if (!starts) {
             /* no viable transitions, move on */
             if (match_full_words)
                 goto SKIP_TO_NEXT_WORD;
             continue;
         }
-        /* "fork" a child to search from this index */
-        tmp = malloc(sizeof(pthread_list_ele_t));
+        /* "fork" a child to search from this index, with its repetition
+         * counters allocated in the same block and starting from zero */
+        tmp = malloc(sizeof(pthread_list_ele_t) +
+                     sizeof(unsigned int) * nfa->counter_count);
         if (tail == NULL)
             head = tmp;
         else
@@ -417,6 +1363,13 @@ TOP_OF_FOR_LOOP:
         tmp->arg.pos = pos;
         tmp->arg.end = 0;
         tmp->arg.case_insensitive = case_insensitive;
+        tmp->arg.counter_count = nfa->counter_count;
+        tmp->arg.counters = NULL;
+        tmp->arg.hits = NULL;
+        if (nfa->counter_count != 0) {
+            tmp->arg.counters = (unsigned int *)(tmp + 1);
+            memset(tmp->arg.counters, 0, sizeof(unsigned int) * nfa->counter_count);
+        }
         if (match_full_lines) {
             match_status = (match_status_t)run_nfa(&tmp->arg);
             if (buf[tmp->arg.end] != '\0') {
@@ -505,3 +1458,48 @@ RETURN_OR_INVERT_STATUS:
     return match_status;
 }
 
+
+
+/* Records in hits every pattern of the union nfa which matches somewhere in
+ * buf. Unlike search_buffer(), a match does not end the search from its
+ * start position, since other patterns may match there too. hits->stamp
+ * must differ from that of any earlier buffer searched with the same hits,
+ * and hits->hit_count must be 0. */
+void find_patterns(char *buf, size_t bufsize, nfa_t *nfa,
+                   pattern_hits_t *hits, int case_insensitive) {
+    size_t pos;
+    pthread_list_ele_t *head = NULL, *tmp;
+    char c;
+    for (pos = 0; pos < bufsize && buf[pos] != '\0'; pos++) {
+        c = buf[pos];
+        if (case_insensitive && c >= 0x41 && c <= 0x5A)
+            c |= 0x20;
+        if (!may_start_match(nfa->q0, c))
+            continue;
+        tmp = malloc(sizeof(pthread_list_ele_t) +
+                     sizeof(unsigned int) * nfa->counter_count);
+        tmp->next = head;
+        head = tmp;
+        tmp->arg.buf = buf;
+        tmp->arg.bufsize = bufsize;
+        tmp->arg.state = nfa->q0;
+        tmp->arg.qaccept = nfa->qaccept;
+        tmp->arg.pos = pos;
+        tmp->arg.end = 0;
+        tmp->arg.case_insensitive = case_insensitive;
+        tmp->arg.counter_count = nfa->counter_count;
+        tmp->arg.counters = NULL;
+        tmp->arg.hits = hits;
+        if (nfa->counter_count != 0) {
+            tmp->arg.counters = (unsigned int *)(tmp + 1);
+            memset(tmp->arg.counters, 0, sizeof(unsigned int) * nfa->counter_count);
+        }
+        pthread_create(&tmp->thread, NULL, &run_nfa, &tmp->arg);
+    }
+    while (head != NULL) {
+        pthread_join(head->thread, NULL);
+        tmp = head;
+        head = head->next;
+        free(tmp);
+    }
+}
@@ -0,0 +1,664 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "include/nfa.h"
+#include "include/utf8.h"
+#include "include/filepaths.h"
+#include "include/index.h"
+#include "include/checkpoint.h"
+#include "include/search.h"
+#include "include/compress.h"
+
+
+#define DEFAULT_BUFSIZE 512
+
+#define ERR_EOF     0
+
+#define COLOR_RESET ("\e[0;39;49m")
+
+/* Files opened ahead of the one being searched */
+#define PREFETCH_DEPTH  8
+
+/* Bytes of each file which the kernel is asked to read ahead of the search
+ * at a time, so that prefetching many large files cannot evict the pages
+ * of the one being searched */
+#define PREFETCH_WINDOW (4 * 1024 * 1024)
+
+
+typedef enum {
+    DEFAULT = 0,
+    BLACK   = 30,
+    RED     = 31,
+    GREEN   = 32,
+    YELLOW  = 33,
+    BLUE    = 34,
+    MAGENTA = 35,
+    CYAN    = 36,
+    WHITE   = 37,
+} color_t;
+
+typedef enum {
+    STANDARD    = 0,
+    BOLD        = 1,
+} bold_t;
+
+/* Ring of the most recent unprinted lines, kept for printing as context
+ * before the next match. Lines are never copied into the ring: instead, the
+ * buffer holding a line is swapped into a slot, and the buffer previously in
+ * that slot becomes the read buffer for the next line. Memory use depends
+ * only on the number of context lines, and unprinted lines cost one swap. */
+typedef struct line_ring {
+    char **bufs;
+    size_t *bufsizes;
+    size_t *lens;       /* bytes read into each buffer, including the '\0' */
+    size_t capacity;
+    size_t start;       /* slot of the oldest line */
+    size_t count;
+} line_ring_t;
+
+
+/* A file opened ahead of being searched */
+typedef struct prefetched_file {
+    char *path;
+    FILE *infile;   /* NULL if the file could not be opened */
+} prefetched_file_t;
+
+/* Stream over a prefetched file, which asks the kernel to read in the next
+ * PREFETCH_WINDOW bytes whenever the search comes within half a window of
+ * the end of what was asked for before */
+typedef struct readahead_file {
+    FILE *infile;
+    off_t offset;       /* next byte to read */
+    off_t advised;      /* end of the bytes asked for so far */
+} readahead_file_t;
+
+/* Bounded queue of files handed from the prefetching thread to the search,
+ * in the order of the list being searched */
+typedef struct prefetch_queue {
+    struct filepath_node *filepaths;
+    prefetched_file_t files[PREFETCH_DEPTH];
+    size_t start;
+    size_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} prefetch_queue_t;
+
+
+/* Returns number of bytes read, including null terminator.
+ * Return value of 0 means EOF, so caller should close file.
+ * With ARG_FLAG_UTF8 in flags, input is only binary if it is not valid
+ * UTF-8, rather than if it has any byte above 0x7f. */
+size_t fill_buffer(FILE *infile, char **buf, size_t *bufsize, int *binary, arg_flag_t flags) {
+    int c;  /* not char, so that a 0xff byte is not taken for EOF */
+    size_t bytes_read = 0;
+    int utf8_pending = 0;   /* continuation bytes expected, with ARG_FLAG_UTF8 */
+    c = fgetc(infile);
+    if (c == EOF || bufsize == 0)
+        return ERR_EOF;
+    if (c == '\n' && *binary == 0) {
+        (*buf)[bytes_read] = '\0';
+        return 1;
+    }
+    if (c == '\0' && !(flags & ARG_FLAG_A))
+        *binary = 1;
+    else if ((flags & ARG_FLAG_UTF8) && !(flags & ARG_FLAG_A) &&
+            !utf8_byte_valid(c, &utf8_pending))
+        *binary = 1;
+    (*buf)[bytes_read] = (c == '\0' && *binary) ? '\n' : c;
+    bytes_read++;
+    /* Need to fgetc(infile) after checking bytes_read, and dont' want to
+     * update bytes_read until c has been processed */
+    while (1) {
+        while (bytes_read < *bufsize) {
+            c = fgetc(infile);
+            if (c == EOF || (c == '\n' && *binary == 0)) {
+                if (utf8_pending != 0 && !(flags & ARG_FLAG_A))
+                    *binary = 1;    /* line ended within a UTF-8 sequence */
+                (*buf)[bytes_read] = '\0';
+                bytes_read++;
+                return bytes_read;
+            } else if (c == '\0' && !(flags & ARG_FLAG_A)) {
+                /* Binary file, ignore unless -a flag given... for now, always
+                 * print error and stop reading file */
+                *binary = 1;
+            } else if (flags & ARG_FLAG_UTF8) {
+                if (!(flags & ARG_FLAG_A) && !utf8_byte_valid(c, &utf8_pending))
+                    *binary = 1;
+            }
+            /* *binary |= (c >> 7) & 1; */
+            /* search_buffer() stops at a '\0', so in a binary file one ends
+             * a line as a newline would, leaving the rest to be searched */
+            (*buf)[bytes_read] = (c == '\0' && *binary) ? '\n' : c;
+            bytes_read++;
+        }
+        if (bytes_read < *bufsize || *binary != 0) {
+            break;
+        }
+        /* Buffer filled but not done with line (in text mode), so double buffer size */
+        *bufsize <<= 1;
+        *buf = realloc(*buf, sizeof(char) * (*bufsize));
+    }
+    return bytes_read;
+}
+
+
+size_t preserve_buffer_overlap(char **buf, size_t *bufsize, size_t bytes_read, size_t start) {
+    size_t i, bytes_to_preserve = bytes_read - start;
+    /* If majority of buffer is part of a partial match, double queue size */
+    if (bytes_to_preserve > ((*bufsize) >> 1)) {
+        (*bufsize) <<= 1;
+        *buf = realloc(*buf, sizeof(char) * (*bufsize));
+    }
+    for (i = 0; i < bytes_to_preserve; i++)
+        (*buf)[i] = (*buf)[start + i];
+    return bytes_to_preserve;
+}
+
+
+void print_str_colored(search_opts_t *opts, char *str, color_t color, bold_t bold) {
+    if (opts->color) {
+        switch (bold) {
+        case STANDARD:
+            fprintf(opts->outfile, "\e[%dm%s%s", color, str, COLOR_RESET);
+            break;
+        case BOLD:
+            fprintf(opts->outfile, "\e[1;%dm%s%s", color, str, COLOR_RESET);
+            break;
+        }
+    } else {
+        fputs(str, opts->outfile);
+    }
+}
+
+
+/* Writes buf[start] through buf[end - 1] directly into the output buffer,
+ * without modifying buf or formatting the span */
+void print_from_buffer(search_opts_t *opts, char *buf, size_t start, size_t end,
+                       color_t color, bold_t bold) {
+    if (end <= start)
+        return;
+    if (color != DEFAULT && opts->color) {
+        switch (bold) {
+        case STANDARD:
+            fprintf(opts->outfile, "\e[%dm", color);
+            break;
+        case BOLD:
+            fprintf(opts->outfile, "\e[1;%dm", color);
+            break;
+        }
+        fwrite(buf + start, sizeof(char), end - start, opts->outfile);
+        fputs(COLOR_RESET, opts->outfile);
+    } else {
+        fwrite(buf + start, sizeof(char), end - start, opts->outfile);
+    }
+}
+
+
+void init_line_ring(line_ring_t *ring, size_t capacity) {
+    ring->capacity = capacity;
+    ring->start = 0;
+    ring->count = 0;
+    ring->bufs = NULL;
+    ring->bufsizes = NULL;
+    ring->lens = NULL;
+    if (capacity == 0)
+        return;
+    ring->bufs = calloc(capacity, sizeof(char *));
+    ring->bufsizes = calloc(capacity, sizeof(size_t));
+    ring->lens = calloc(capacity, sizeof(size_t));
+}
+
+
+void cleanup_line_ring(line_ring_t *ring) {
+    size_t i;
+    for (i = 0; i < ring->capacity; i++)
+        free(ring->bufs[i]);
+    free(ring->bufs);
+    free(ring->bufsizes);
+    free(ring->lens);
+}
+
+
+/* Moves the line in *buf into the ring, evicting the oldest line if the ring
+ * is full, and replaces *buf with a spare buffer to read the next line into. */
+void push_line_ring(line_ring_t *ring, char **buf, size_t *bufsize, size_t bytes_read) {
+    size_t slot;
+    char *spare;
+    size_t spare_size;
+    if (ring->count == ring->capacity) {
+        slot = ring->start;
+        ring->start = (ring->start + 1) % ring->capacity;
+    } else {
+        slot = (ring->start + ring->count) % ring->capacity;
+        ring->count++;
+    }
+    spare = ring->bufs[slot];
+    spare_size = ring->bufsizes[slot];
+    ring->bufs[slot] = *buf;
+    ring->bufsizes[slot] = *bufsize;
+    ring->lens[slot] = bytes_read;
+    if (spare == NULL) {
+        spare_size = DEFAULT_BUFSIZE;
+        spare = malloc(sizeof(char) * spare_size);
+    }
+    *buf = spare;
+    *bufsize = spare_size;
+}
+
+
+/* Prints the line number which prefixes a line when -n is given, followed by
+ * ':' for a matching line or '-' for a line of context. */
+void print_line_number(search_opts_t *opts, size_t line_number, char separator) {
+    char str[24];
+    sprintf(str, "%lu", (unsigned long)line_number);
+    print_str_colored(opts, str, GREEN, STANDARD);
+    str[0] = separator;
+    str[1] = '\0';
+    print_str_colored(opts, str, CYAN, STANDARD);
+}
+
+
+/* Prints the lines in the ring, oldest first, and empties it. The buffers
+ * themselves are kept as spares. If first_line_number is not 0, each line is
+ * prefixed with its line number, starting from first_line_number. */
+void print_line_ring(search_opts_t *opts, line_ring_t *ring, size_t first_line_number) {
+    size_t i, slot;
+    for (i = 0; i < ring->count; i++) {
+        slot = (ring->start + i) % ring->capacity;
+        if (first_line_number != 0)
+            print_line_number(opts, first_line_number + i, '-');
+        print_from_buffer(opts, ring->bufs[slot], 0, ring->lens[slot] - 1, DEFAULT, STANDARD);
+        fputc('\n', opts->outfile);
+    }
+    ring->start = 0;
+    ring->count = 0;
+}
+
+
+match_status_t search_file(char *filename, FILE *infile, nfa_t *nfa, search_opts_t *opts) {
+    char *buf, *fake_buf;
+    size_t bytes_read, bufsize = DEFAULT_BUFSIZE, bytes_preserved, bytes_remaining, earliest_partial_start, i;
+    int binary = 0;
+    arg_flag_t flags = opts->flags;
+    size_t before_context = opts->before_context, after_context = opts->after_context;
+    match_list_t match_list;
+    match_list_ele_t *tmp;
+    match_status_t status, confirmed_match = MATCH_NONE;
+    line_ring_t before_lines;
+    /* line_number is that of the line in buf, and last_printed is that of
+     * the most recently printed line, or 0 if none have been printed */
+    size_t line_number = 1 + opts->lines_skipped, last_printed = 0, after_remaining = 0;
+    /* Need some way of knowing whether a match was in progress at the
+     * end of the buffer, in which case the buffer size should be
+     * doubled and filled and any child thread in progress should be
+     * re-spawned with the same start index, end state, and positioned
+     * at the end of the original buffer (or at the first index of the
+     * extension).
+     * Current solution: match_status_t status
+     */
+    match_list.head = NULL;
+    match_list.tail = NULL;
+    init_line_ring(&before_lines, before_context);
+    buf = malloc(sizeof(char) * bufsize);
+    if ((bytes_read = fill_buffer(infile, &buf, &bufsize, &binary, flags)) == ERR_EOF)
+        goto RETURN_STATUS;
+    while (binary == 0) {
+        status = search_buffer(buf, bufsize, nfa, &match_list,
+                               flags & ARG_FLAG_I,
+                               flags & ARG_FLAG_W,
+                               flags & ARG_FLAG_X,
+                               flags & ARG_FLAG_V);
+        switch (status) {
+        case MATCH_FOUND:
+            confirmed_match = MATCH_FOUND;
+            if ((before_context != 0 || after_context != 0) && last_printed != 0 &&
+                    line_number - before_lines.count > last_printed + 1) {
+                /* not contiguous with the previous group of lines */
+                print_str_colored(opts, "--", CYAN, STANDARD);
+                fputc('\n', opts->outfile);
+            }
+            print_line_ring(opts, &before_lines, (flags & ARG_FLAG_N) ?
+                            line_number - before_lines.count : 0);
+            last_printed = line_number;
+            after_remaining = after_context;
+            if ((flags & ARG_FLAG_N) && !(flags & ARG_FLAG_O))
+                print_line_number(opts, line_number, ':');
+            i = 0;
+            if (flags & ARG_FLAG_V) {
+                while (match_list.head != NULL) {
+                    tmp = match_list.head;
+                    match_list.head = tmp->next;
+                    free(tmp);
+                }
+            }
+            while (match_list.head != NULL) {
+                if (match_list.head->end == bufsize) {
+                    /* reached the end of complete matches, so stop printing
+                     * and copy from start into beginning of buffer (by
+                     * falling through to MATCH_PROGRESS case, and make
+                     * match_list continue from here */
+                    break;
+                }
+                if (match_list.head->start >= i && (flags & ARG_FLAG_O)) {
+                    /* print only the current match, on its own line */
+                    if (flags & ARG_FLAG_N)
+                        print_line_number(opts, line_number, ':');
+                    print_from_buffer(opts, buf, match_list.head->start, match_list.head->end, RED, BOLD);
+                    fputc('\n', opts->outfile);
+                    i = match_list.head->end;
+                } else if (match_list.head->start >= i) {
+                    /* print line between previous and current match */
+                    print_from_buffer(opts, buf, i, match_list.head->start, DEFAULT, STANDARD);
+                    /* print current match */
+                    print_from_buffer(opts, buf, match_list.head->start, match_list.head->end, RED, BOLD);
+                    i = match_list.head->end;
+                }
+                tmp = match_list.head;
+                match_list.head = tmp->next;
+                free(tmp);
+            }
+            if (match_list.head == NULL) {
+                match_list.tail = NULL;
+                if (!(flags & ARG_FLAG_O)) {
+                    print_from_buffer(opts, buf, i, bytes_read - 1, DEFAULT, STANDARD);
+                    fputc('\n', opts->outfile);
+                }
+                if ((bytes_read = fill_buffer(infile, &buf, &bufsize, &binary, flags)) == ERR_EOF)
+                    goto RETURN_STATUS;
+                line_number++;
+                break;
+            }
+            /* else there were some partial matches, so handle them by
+             * falling through to case MATCH_PROGRESS */
+        case MATCH_PROGRESS:    /* only possible if upper limit on bufsize for text files */
+            assert(0 && "don't allow partial matches on text files");   /* don't bother */
+            /* No full matches, so first match in queue must be in
+             * progress, and must also be the earliest match index */
+            bytes_preserved = preserve_buffer_overlap(&buf, &bufsize, bytes_read, match_list.head->start);
+            /* If text, fill_buffer() might changes the bufsize, so the
+             * following parameters might be unchanged by fill_buffer(),
+             * which is very bad. NOT TRUE, since the whole reason we're
+             * here is that the buffer size is fixed.
+             * Nonetheless, disallow fixed buffer size for text input. */
+            while (match_list.head != NULL) {
+                tmp = match_list.head;
+                match_list.head = tmp->next;
+                free(tmp);
+            }
+            match_list.tail = NULL;
+            fake_buf = buf + bytes_preserved;
+            bytes_remaining = bufsize - bytes_preserved;
+            bytes_read = bytes_preserved +
+                fill_buffer(infile, &fake_buf, &bytes_remaining, &binary, flags);
+            if (bytes_read == bytes_preserved)  /* fill_buffer() returned ERR_EOF */
+                goto RETURN_STATUS;
+            break;
+        case MATCH_NONE:
+            while (match_list.head != NULL) {
+                /* if invert_match, will have matches in the list, else does nothing */
+                tmp = match_list.head;
+                match_list.head = tmp->next;
+                free(tmp);
+            }
+            match_list.tail = NULL;
+            if (after_remaining != 0) {
+                /* print as context after the previous match */
+                if (flags & ARG_FLAG_N)
+                    print_line_number(opts, line_number, '-');
+                print_from_buffer(opts, buf, 0, bytes_read - 1, DEFAULT, STANDARD);
+                fputc('\n', opts->outfile);
+                last_printed = line_number;
+                after_remaining--;
+            } else if (before_context != 0) {
+                /* keep the line in case it is context before a later match */
+                push_line_ring(&before_lines, &buf, &bufsize, bytes_read);
+            }
+            if ((bytes_read = fill_buffer(infile, &buf, &bufsize, &binary, flags)) == ERR_EOF)
+                goto RETURN_STATUS;
+            line_number++;
+            /* assert((match_list.head | match_list.tail) == NULL); */
+            break;
+        }
+    }
+    while (binary != 0) {   /* always true once true; a convenient "while (1)" */
+        status = search_buffer(buf, bufsize, nfa, &match_list,
+                               flags & ARG_FLAG_I,
+                               flags & ARG_FLAG_W,
+                               flags & ARG_FLAG_X,
+                               flags & ARG_FLAG_V);
+        switch (status) {
+        case MATCH_NONE:
+            while (match_list.head != NULL) {
+                /* if invert_match, will have matches in the list, else does nothing */
+                tmp = match_list.head;
+                match_list.head = tmp->next;
+                free(tmp);
+            }
+            match_list.tail = NULL;
+            if ((bytes_read = fill_buffer(infile, &buf, &bufsize, &binary, flags)) == ERR_EOF)
+                goto RETURN_STATUS;
+            break;
+        case MATCH_PROGRESS:
+            /* Possibly full matches in list, so check full list to see if a
+             * full match is found */
+            earliest_partial_start = match_list.head->start;
+            while (match_list.head != NULL) {
+                if (match_list.head->end != 0)  /* only MATCH_FOUND has end != 0 */
+                    goto BINARY_MATCH_FOUND;
+                tmp = match_list.head;
+                match_list.head = tmp->next;
+                free(tmp);
+            }
+            match_list.tail = NULL;
+            /* No full matches */
+            bytes_preserved = preserve_buffer_overlap(&buf, &bufsize, bytes_read, earliest_partial_start);
+            /* If binary, fill_buffer() never changes the bufsize, so the
+             * following parameters should be unchanged by fill_buffer() */
+            fake_buf = buf + bytes_preserved;
+            bytes_remaining = bufsize - bytes_preserved;
+            bytes_read = bytes_preserved +
+                fill_buffer(infile, &fake_buf, &bytes_remaining, &binary, flags);
+            if (bytes_read == bytes_preserved) {    /* fill_buffer() returned ERR_EOF */
+                confirmed_match = MATCH_NONE;
+                goto RETURN_STATUS;
+            }
+            break;
+        case MATCH_FOUND:
+BINARY_MATCH_FOUND:
+            confirmed_match = MATCH_FOUND;
+            while (match_list.head != NULL) {
+                /* don't care about match positions, just whether they occured */
+                tmp = match_list.head;
+                match_list.head = tmp->next;
+                free(tmp);
+            }
+            match_list.tail = NULL;
+            fprintf(opts->errfile, "Binary file %s matches\n", filename);
+            goto RETURN_STATUS;
+        }
+    }
+RETURN_STATUS:
+    while (match_list.head != NULL) {
+        tmp = match_list.head;
+        match_list.head = tmp->next;
+        free(tmp);
+    }
+    match_list.tail = NULL;
+    cleanup_line_ring(&before_lines);
+    free(buf);
+    return confirmed_match;
+}
+
+
+/* Opens the file, and asks the kernel to start reading in its first
+ * PREFETCH_WINDOW bytes */
+void prefetch_file(prefetched_file_t *file, char *path) {
+    file->path = path;
+    file->infile = fopen(path, "r");
+    if (file->infile != NULL) {
+        posix_fadvise(fileno(file->infile), 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fileno(file->infile), 0, PREFETCH_WINDOW, POSIX_FADV_WILLNEED);
+    }
+}
+
+
+ssize_t read_readahead_file(void *cookie, char *buf, size_t size) {
+    readahead_file_t *file = (readahead_file_t *)cookie;
+    int fd = fileno(file->infile);
+    ssize_t bytes;
+    if (file->offset + PREFETCH_WINDOW / 2 >= file->advised) {
+        posix_fadvise(fd, file->advised, PREFETCH_WINDOW, POSIX_FADV_WILLNEED);
+        file->advised += PREFETCH_WINDOW;
+    }
+    do {
+        bytes = read(fd, buf, size);
+    } while (bytes < 0 && errno == EINTR);
+    if (bytes > 0)
+        file->offset += bytes;
+    return bytes;
+}
+
+
+int close_readahead_file(void *cookie) {
+    readahead_file_t *file = (readahead_file_t *)cookie;
+    fclose(file->infile);
+    free(file);
+    return 0;
+}
+
+
+/* Returns a stream over infile, opened by prefetch_file(), which moves the
+ * readahead window along as it is read. Closing the stream closes infile.
+ * If the stream cannot be created, infile is returned itself. */
+FILE *open_readahead(FILE *infile) {
+    readahead_file_t *file = malloc(sizeof(readahead_file_t));
+    cookie_io_functions_t functions;
+    FILE *stream;
+    file->infile = infile;
+    file->offset = 0;
+    file->advised = PREFETCH_WINDOW;
+    memset(&functions, 0, sizeof(functions));
+    functions.read = &read_readahead_file;
+    functions.close = &close_readahead_file;
+    if ((stream = fopencookie(file, "r", functions)) == NULL) {
+        free(file);
+        return infile;
+    }
+    return stream;
+}
+
+
+/* Prefetches each file in the list, staying at most PREFETCH_DEPTH files
+ * ahead of the search, so that reading upcoming files overlaps with
+ * searching the current one */
+void *prefetch_files(void *arg) {
+    prefetch_queue_t *queue = (prefetch_queue_t *)arg;
+    struct filepath_node *curr_fp;
+    prefetched_file_t file;
+    for (curr_fp = queue->filepaths; curr_fp != NULL; curr_fp = curr_fp->next) {
+        prefetch_file(&file, curr_fp->path);
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == PREFETCH_DEPTH)
+            pthread_cond_wait(&queue->not_full, &queue->lock);
+        queue->files[(queue->start + queue->count) % PREFETCH_DEPTH] = file;
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+
+void next_prefetched_file(prefetch_queue_t *queue, prefetched_file_t *file) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    *file = queue->files[queue->start];
+    queue->start = (queue->start + 1) % PREFETCH_DEPTH;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+match_status_t search_prefetched_file(prefetched_file_t *file, nfa_t *nfa, search_opts_t *opts) {
+    search_opts_t file_opts = *opts;
+    match_status_t status;
+    FILE *infile = file->infile;
+    if (infile == NULL) {
+        fprintf(opts->errfile, "ERROR: could not open file: %s\n", file->path);
+        opts->failed = 1;
+        return MATCH_NONE;
+    }
+    if (opts->flags & ARG_FLAG_Z)
+        /* closes infile, and sets opts->failed if it cannot be decompressed */
+        return search_compressed_file(file->path, infile, nfa, opts);
+    if (opts->checkpoint != NULL)
+        /* only search what was added since the last checkpoint */
+        infile = open_checkpointed(opts->checkpoint, file->path, infile, &file_opts.lines_skipped);
+    else
+        infile = open_readahead(infile);
+    status = search_file(file->path, infile, nfa, &file_opts);
+    fclose(infile);
+    return status;
+}
+
+
+/* Searches each file in the list in order, while a separate thread opens
+ * and starts reading in the files which follow */
+match_status_t search_filepaths(struct filepath_node *filepaths, nfa_t *nfa, search_opts_t *opts) {
+    struct filepath_node *curr_fp;
+    prefetch_queue_t queue;
+    prefetched_file_t file;
+    pthread_t prefetcher;
+    match_status_t status = MATCH_NONE;
+    queue.filepaths = filepaths;
+    queue.start = 0;
+    queue.count = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+    if (filepaths == NULL || filepaths->next == NULL ||
+            pthread_create(&prefetcher, NULL, &prefetch_files, &queue) != 0) {
+        /* nothing to overlap, or no thread to do it, so search serially */
+        for (curr_fp = filepaths; curr_fp != NULL; curr_fp = curr_fp->next) {
+            prefetch_file(&file, curr_fp->path);
+            if (search_prefetched_file(&file, nfa, opts) == MATCH_FOUND)
+                status = MATCH_FOUND;
+        }
+    } else {
+        for (curr_fp = filepaths; curr_fp != NULL; curr_fp = curr_fp->next) {
+            next_prefetched_file(&queue, &file);
+            if (search_prefetched_file(&file, nfa, opts) == MATCH_FOUND)
+                status = MATCH_FOUND;
+        }
+        pthread_join(prefetcher, NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.not_empty);
+    pthread_cond_destroy(&queue.not_full);
+    return status;
+}
+
+
+match_status_t search_recursive(char *filepath, nfa_t *nfa, search_opts_t *opts) {
+    struct filepath_node *filepaths;
+    match_status_t status;
+    filepaths = build_recursive_filepaths_list(filepath, opts->filter, opts->errfile);
+    if ((opts->flags & ARG_FLAG_USE_INDEX) && !(opts->flags & ARG_FLAG_V))
+        /* with -v, files lacking the expression are the ones that match */
+        filepaths = filter_filepaths_by_index(filepath, filepaths, nfa);
+    status = search_filepaths(filepaths, nfa, opts);
+    cleanup_filepaths(filepaths);
+    return status;
+}
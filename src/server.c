@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "include/nfa.h"
+#include "include/filepaths.h"
+#include "include/search.h"
+#include "include/server.h"
+#include "include/compress.h"
+
+
+/* Bump whenever the layout of requests or replies changes */
+#define PROTOCOL_VERSION    1
+
+#define REQUEST_MAGIC   "PERGREQ"
+
+/* Descriptors passed with each request: the client's stdin, stdout, stderr
+ * and working directory, in that order */
+#define REQUEST_FD_COUNT    4
+#define REQUEST_FD_CWD      3
+
+#define MAX_PAYLOAD_SIZE    (64 * 1024 * 1024)
+
+#define PATTERN_CACHE_SIZE  64
+
+#define REQUEST_QUEUE_SIZE  64
+
+#define OUTPUT_BUFSIZE  65536
+
+
+/* Status byte sent back to the client once its results have been written */
+typedef enum {
+    REPLY_MATCH     = 0,
+    REPLY_NO_MATCH  = 1,
+    REPLY_ERROR     = 2,
+} reply_t;
+
+/* A request is this header, sent along with the client's descriptors,
+ * followed by a payload of the expression and then each path, all '\0'
+ * terminated. Results are written by the server straight to the client's
+ * stdout and stderr, so only the reply byte comes back over the socket. */
+typedef struct request_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t color;
+    uint32_t path_count;
+    uint64_t before_context;
+    uint64_t after_context;
+    uint64_t payload_size;
+} request_header_t;
+
+/* An expression compiled by the server. The nfa is a relocated heap image,
+ * which does not depend on the state list in nfa.c, so any number of them
+ * can be searched at once. */
+typedef struct pattern_entry {
+    char *expression;
+    int key_flags;
+    nfa_t *nfa;
+    int refs;                   /* requests currently searching with nfa */
+    unsigned long last_used;    /* 0 if the entry has never been used */
+} pattern_entry_t;
+
+/* Bounded queue of accepted connections waiting for a worker */
+typedef struct request_queue {
+    int conns[REQUEST_QUEUE_SIZE];
+    size_t start;
+    size_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} request_queue_t;
+
+/* Control message buffer large enough for the descriptors of a request */
+typedef union request_control {
+    char buf[CMSG_SPACE(sizeof(int) * REQUEST_FD_COUNT)];
+    struct cmsghdr align;
+} request_control_t;
+
+
+static pattern_entry_t pattern_cache[PATTERN_CACHE_SIZE];
+static unsigned long pattern_clock = 0;
+static pthread_mutex_t pattern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* build_nfa() keeps the states it creates in static variables, so only one
+ * expression may be compiled at a time */
+static pthread_mutex_t build_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static request_queue_t request_queue = {
+    {0}, 0, 0,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+
+/* Returns 0 once all len bytes have been received, or -1 on error or EOF */
+int receive_fully(int conn, void *buf, size_t len) {
+    ssize_t received;
+    while (len > 0) {
+        received = recv(conn, buf, len, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return -1;
+        buf = (char *)buf + received;
+        len -= received;
+    }
+    return 0;
+}
+
+
+/* Returns 0 once all len bytes have been sent, or -1 on error */
+int send_fully(int conn, void *buf, size_t len) {
+    ssize_t sent;
+    while (len > 0) {
+        sent = send(conn, buf, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0)
+            return -1;
+        buf = (char *)buf + sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+
+/* Compiles expression into an nfa which owns all of its memory. If the
+ * expression is invalid, the reason is written to errfile. */
+nfa_t *compile_pattern(char *expression, int case_insensitive, int utf8, FILE *errfile) {
+    nfa_t *nfa;
+    char *image;
+    size_t image_size;
+    pthread_mutex_lock(&build_lock);
+    set_build_errfile(errfile);
+    nfa = build_nfa(expression, case_insensitive, utf8);
+    set_build_errfile(NULL);
+    if (nfa == NULL) {
+        /* drop the states built before the error, so they don't leak into
+         * the next expression compiled */
+        cleanup_states();
+        pthread_mutex_unlock(&build_lock);
+        return NULL;
+    }
+    image_size = flatten_nfa(nfa, &image);
+    free_nfa(nfa);
+    pthread_mutex_unlock(&build_lock);
+    nfa = relocate_nfa(image, image_size, NFA_STORAGE_HEAP, image, image_size);
+    if (nfa == NULL) {
+        fprintf(errfile, "ERROR: could not compile expression: %s\n", expression);
+        free(image);
+    }
+    return nfa;
+}
+
+
+/* Returns the nfa for expression, compiling it only if it isn't cached. The
+ * cache entry now referencing it is stored in *entry, which is NULL if the
+ * nfa could not be cached. Either way, release_pattern() must be called
+ * once the search is done. Returns NULL if the expression is invalid, having
+ * written why to errfile. */
+nfa_t *acquire_pattern(char *expression, int key_flags, FILE *errfile, pattern_entry_t **entry) {
+    pattern_entry_t *victim = NULL;
+    nfa_t *nfa;
+    char *copy;
+    int i;
+    pthread_mutex_lock(&pattern_lock);
+    for (i = 0; i < PATTERN_CACHE_SIZE; i++) {
+        if (pattern_cache[i].nfa != NULL && pattern_cache[i].key_flags == key_flags &&
+                strcmp(pattern_cache[i].expression, expression) == 0) {
+            pattern_cache[i].refs++;
+            pattern_cache[i].last_used = ++pattern_clock;
+            *entry = &pattern_cache[i];
+            pthread_mutex_unlock(&pattern_lock);
+            return pattern_cache[i].nfa;
+        }
+    }
+    pthread_mutex_unlock(&pattern_lock);
+    *entry = NULL;
+    nfa = compile_pattern(expression, key_flags & ARG_FLAG_I, key_flags & ARG_FLAG_UTF8, errfile);
+    if (nfa == NULL)
+        return NULL;
+    copy = malloc(strlen(expression) + 1);
+    if (copy == NULL)
+        return nfa;
+    strcpy(copy, expression);
+    pthread_mutex_lock(&pattern_lock);
+    /* unused entries come first, then the least recently used idle entry */
+    for (i = 0; i < PATTERN_CACHE_SIZE; i++) {
+        if (pattern_cache[i].refs == 0 &&
+                (victim == NULL || pattern_cache[i].last_used < victim->last_used))
+            victim = &pattern_cache[i];
+    }
+    if (victim == NULL) {
+        /* every entry is in use, so this nfa is only used by this request */
+        pthread_mutex_unlock(&pattern_lock);
+        free(copy);
+        return nfa;
+    }
+    if (victim->nfa != NULL) {
+        free_nfa(victim->nfa);
+        free(victim->expression);
+    }
+    victim->expression = copy;
+    victim->key_flags = key_flags;
+    victim->nfa = nfa;
+    victim->refs = 1;
+    victim->last_used = ++pattern_clock;
+    *entry = victim;
+    pthread_mutex_unlock(&pattern_lock);
+    return nfa;
+}
+
+
+void release_pattern(pattern_entry_t *entry, nfa_t *nfa) {
+    if (entry == NULL) {
+        free_nfa(nfa);
+        return;
+    }
+    pthread_mutex_lock(&pattern_lock);
+    entry->refs--;
+    pthread_mutex_unlock(&pattern_lock);
+}
+
+
+void push_request(int conn) {
+    request_queue_t *queue = &request_queue;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == REQUEST_QUEUE_SIZE)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    queue->conns[(queue->start + queue->count) % REQUEST_QUEUE_SIZE] = conn;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+int pop_request(void) {
+    request_queue_t *queue = &request_queue;
+    int conn;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    conn = queue->conns[queue->start];
+    queue->start = (queue->start + 1) % REQUEST_QUEUE_SIZE;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return conn;
+}
+
+
+/* Receives a request header and the descriptors sent with it into fds.
+ * Returns 0 on success, or -1 if the request is malformed, in which case
+ * any descriptors received must still be closed by the caller. */
+int receive_header(int conn, request_header_t *header, int *fds) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    request_control_t control;
+    ssize_t received;
+    size_t i, fd_count = 0, passed;
+    int fd;
+    for (i = 0; i < REQUEST_FD_COUNT; i++)
+        fds[i] = -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = header;
+    iov.iov_len = sizeof(request_header_t);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    do {
+        received = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0)
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        passed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < passed; i++) {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (fd_count < REQUEST_FD_COUNT)
+                fds[fd_count++] = fd;
+            else
+                close(fd);
+        }
+    }
+    if (fd_count != REQUEST_FD_COUNT || (msg.msg_flags & MSG_CTRUNC))
+        return -1;
+    if ((size_t)received < sizeof(request_header_t) &&
+            receive_fully(conn, (char *)header + received, sizeof(request_header_t) - received) != 0)
+        return -1;
+    if (memcmp(header->magic, REQUEST_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != PROTOCOL_VERSION ||
+            header->payload_size > MAX_PAYLOAD_SIZE ||
+            header->path_count > header->payload_size)
+        return -1;
+    return 0;
+}
+
+
+/* Runs the request read from conn, writing results to the client's stdout
+ * and stderr, then replies with the status of the search */
+void handle_request(int conn) {
+    request_header_t header;
+    int fds[REQUEST_FD_COUNT];
+    char *payload = NULL, *end, **paths = NULL;
+    struct filepath_node *filepaths;
+    FILE *infile, *outfile = NULL, *errfile = NULL;
+    search_opts_t opts;
+    file_filter_t filter;
+    pattern_entry_t *entry = NULL;
+    nfa_t *nfa = NULL;
+    match_status_t status = MATCH_NONE;
+    unsigned char reply = REPLY_ERROR;
+    struct ucred peer;
+    socklen_t peer_len = sizeof(peer);
+    size_t i;
+    /* files are opened with the server's privileges, so only its own user
+     * may send requests */
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0 ||
+            peer.uid != getuid()) {
+        close(conn);
+        return;
+    }
+    if (receive_header(conn, &header, fds) != 0)
+        goto DONE;
+    payload = malloc(header.payload_size + 1);
+    paths = malloc(sizeof(char *) * (header.path_count + 1));
+    if (payload == NULL || paths == NULL || receive_fully(conn, payload, header.payload_size) != 0)
+        goto DONE;
+    payload[header.payload_size] = '\0';
+    end = payload + strlen(payload) + 1;
+    for (i = 0; i < header.path_count; i++) {
+        if (end >= payload + header.payload_size)
+            goto DONE;
+        paths[i] = end;
+        end += strlen(end) + 1;
+    }
+    /* relative paths are relative to the client, as is the output naming them */
+    if (fchdir(fds[REQUEST_FD_CWD]) != 0)
+        goto DONE;
+    outfile = fdopen(fds[STDOUT_FILENO], "w");
+    if (outfile == NULL)
+        goto DONE;
+    fds[STDOUT_FILENO] = -1;
+    errfile = fdopen(fds[STDERR_FILENO], "w");
+    if (errfile == NULL)
+        goto DONE;
+    fds[STDERR_FILENO] = -1;
+    if (!header.color)
+        setvbuf(outfile, NULL, _IOFBF, OUTPUT_BUFSIZE);
+    opts.flags = header.flags;
+    opts.before_context = header.before_context;
+    opts.after_context = header.after_context;
+    opts.outfile = outfile;
+    opts.errfile = errfile;
+    opts.color = header.color;
+    opts.checkpoint = NULL;
+    opts.lines_skipped = 0;
+    opts.failed = 0;
+    /* the client searches locally if it needs globs or a size limit */
+    filter.includes = NULL;
+    filter.excludes = NULL;
+    filter.max_filesize = 0;
+    filter.use_ignore_files = !(header.flags & ARG_FLAG_NO_IGNORE);
+    filter.skip_binary = !(header.flags & ARG_FLAG_A);
+    filter.search_compressed = (header.flags & ARG_FLAG_Z) != 0;
+    opts.filter = &filter;
+    nfa = acquire_pattern(payload,
+                          header.flags & (ARG_FLAG_I | ARG_FLAG_W | ARG_FLAG_X | ARG_FLAG_UTF8),
+                          errfile, &entry);
+    if (nfa == NULL)
+        goto DONE;  /* acquire_pattern() has told the client why */
+    if (header.flags & ARG_FLAG_R) {
+        if (header.path_count == 0)
+            status = search_recursive(".", nfa, &opts);
+        for (i = 0; i < header.path_count; i++) {
+            if (search_recursive(paths[i], nfa, &opts) == MATCH_FOUND)
+                status = MATCH_FOUND;
+        }
+    } else if (header.path_count == 0) {
+        infile = fdopen(fds[STDIN_FILENO], "r");
+        if (infile == NULL)
+            goto DONE;
+        fds[STDIN_FILENO] = -1;
+        if (header.flags & ARG_FLAG_Z)
+            /* closes infile */
+            status = search_compressed_file("stdin", infile, nfa, &opts);
+        else {
+            status = search_file("stdin", infile, nfa, &opts);
+            fclose(infile);
+        }
+    } else {
+        filepaths = build_filepaths_list(paths, header.path_count);
+        status = search_filepaths(filepaths, nfa, &opts);
+        cleanup_filepaths(filepaths);
+    }
+    if (!opts.failed)
+        reply = (status == MATCH_FOUND) ? REPLY_MATCH : REPLY_NO_MATCH;
+DONE:
+    if (nfa != NULL)
+        release_pattern(entry, nfa);
+    /* all output must be written before the client is allowed to exit */
+    if (outfile != NULL)
+        fclose(outfile);
+    if (errfile != NULL)
+        fclose(errfile);
+    for (i = 0; i < REQUEST_FD_COUNT; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    free(paths);
+    free(payload);
+    send_fully(conn, &reply, sizeof(reply));
+    close(conn);
+}
+
+
+void *serve_requests(void *arg) {
+    /* give this thread a working directory of its own, which each request
+     * changes to the client's */
+    if (unshare(CLONE_FS) != 0) {
+        fprintf(stderr, "ERROR: could not create worker thread\n");
+        exit(1);
+    }
+    while (1)
+        handle_request(pop_request());
+    return NULL;
+}
+
+
+/* Listens on socket_path, and answers requests sent by run_client() on a
+ * pool of one worker thread per processor. Only returns on error. */
+int serve(char *socket_path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    pthread_t thread;
+    long i, worker_count;
+    int listener, conn, bound;
+    mode_t old_umask;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    /* clients may stop reading their output early, eg. when piped to head */
+    signal(SIGPIPE, SIG_IGN);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    /* replace any socket left behind by a previous server */
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    /* create the socket with mode 0600, so only this user can connect */
+    old_umask = umask(0177);
+    bound = (listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    umask(old_umask);
+    if (!bound || listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "ERROR: could not listen on socket: %s\n", socket_path);
+        if (listener >= 0)
+            close(listener);
+        return 1;
+    }
+    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (worker_count < 1)
+        worker_count = 1;
+    for (i = 0; i < worker_count; i++) {
+        if (pthread_create(&thread, NULL, serve_requests, NULL) != 0) {
+            fprintf(stderr, "ERROR: could not create worker thread\n");
+            close(listener);
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    while (1) {
+        conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn >= 0)
+            push_request(conn);
+        else if (errno != EINTR && errno != ECONNABORTED)
+            break;
+    }
+    fprintf(stderr, "ERROR: could not accept connection on socket: %s\n", socket_path);
+    close(listener);
+    return 1;
+}
+
+
+/* Sends the search to the server listening on socket_path, which writes its
+ * results directly to this process's stdout and stderr. Returns the status
+ * of the search, CLIENT_ERROR if the server could not run it, or -1 if no
+ * server could be reached, in which case the caller should search locally
+ * instead. */
+int run_client(char *socket_path, char *expression, char **paths, int path_count,
+               search_opts_t *opts) {
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    request_control_t control;
+    request_header_t header;
+    int fds[REQUEST_FD_COUNT];
+    char *payload, *end;
+    size_t payload_size;
+    ssize_t sent;
+    unsigned char reply;
+    int conn, i;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn < 0)
+        return -1;
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(conn);
+        return -1;
+    }
+    fds[STDIN_FILENO] = STDIN_FILENO;
+    fds[STDOUT_FILENO] = STDOUT_FILENO;
+    fds[STDERR_FILENO] = STDERR_FILENO;
+    fds[REQUEST_FD_CWD] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fds[REQUEST_FD_CWD] < 0) {
+        close(conn);
+        return -1;
+    }
+    payload_size = strlen(expression) + 1;
+    for (i = 0; i < path_count; i++)
+        payload_size += strlen(paths[i]) + 1;
+    payload = malloc(payload_size);
+    strcpy(payload, expression);
+    end = payload + strlen(expression) + 1;
+    for (i = 0; i < path_count; i++) {
+        strcpy(end, paths[i]);
+        end += strlen(paths[i]) + 1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REQUEST_MAGIC, sizeof(header.magic));
+    header.version = PROTOCOL_VERSION;
+    header.flags = opts->flags;
+    header.color = opts->color;
+    header.path_count = path_count;
+    header.before_context = opts->before_context;
+    header.after_context = opts->after_context;
+    header.payload_size = payload_size;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * REQUEST_FD_COUNT);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * REQUEST_FD_COUNT);
+    do {
+        sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    close(fds[REQUEST_FD_CWD]);
+    if (sent < 0) {
+        free(payload);
+        close(conn);
+        return -1;
+    }
+    /* once the request is sent, the server may already be writing output, so
+     * falling back to a local search could print results twice */
+    if (send_fully(conn, (char *)&header + sent, sizeof(header) - sent) != 0 ||
+            send_fully(conn, payload, payload_size) != 0 ||
+            receive_fully(conn, &reply, sizeof(reply)) != 0) {
+        fprintf(stderr, "ERROR: lost connection to server: %s\n", socket_path);
+        reply = REPLY_ERROR;
+    }
+    free(payload);
+    close(conn);
+    if (reply == REPLY_ERROR)
+        return CLIENT_ERROR;
+    return (reply == REPLY_MATCH) ? MATCH_FOUND : MATCH_NONE;
+}
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "include/utf8.h"
+
+
+/* Surrogates are reserved for UTF-16, and have no UTF-8 encoding */
+#define SURROGATE_LO    0xD800
+#define SURROGATE_HI    0xDFFF
+
+
+/* Decodes the UTF-8 encoded code point at the start of s. Returns the
+ * number of bytes it takes, or 0 if they are not valid UTF-8. Overlong
+ * encodings and surrogates are invalid. */
+size_t utf8_decode(char *s, uint32_t *codepoint) {
+    unsigned char *bytes = (unsigned char *)s;
+    size_t len, i;
+    if (bytes[0] < 0x80) {
+        *codepoint = bytes[0];
+        return 1;
+    } else if (bytes[0] >= 0xC2 && bytes[0] <= 0xDF) {
+        *codepoint = bytes[0] & 0x1F;
+        len = 2;
+    } else if (bytes[0] >= 0xE0 && bytes[0] <= 0xEF) {
+        *codepoint = bytes[0] & 0x0F;
+        len = 3;
+    } else if (bytes[0] >= 0xF0 && bytes[0] <= 0xF4) {
+        *codepoint = bytes[0] & 0x07;
+        len = 4;
+    } else {
+        return 0;
+    }
+    for (i = 1; i < len; i++) {
+        if ((bytes[i] & 0xC0) != 0x80)
+            return 0;   /* also stops at the end of the string */
+        *codepoint = (*codepoint << 6) | (bytes[i] & 0x3F);
+    }
+    if ((len == 3 && *codepoint < 0x800) || (len == 4 && *codepoint < 0x10000) ||
+            *codepoint > UTF8_MAX_CODEPOINT ||
+            (*codepoint >= SURROGATE_LO && *codepoint <= SURROGATE_HI))
+        return 0;
+    return len;
+}
+
+
+/* Returns nonzero if the byte c may come next in valid UTF-8, where
+ * *pending is the number of continuation bytes still expected, which is
+ * updated. Starts from *pending == 0. */
+int utf8_byte_valid(unsigned char c, int *pending) {
+    if (*pending > 0) {
+        (*pending)--;
+        return (c & 0xC0) == 0x80;
+    }
+    if (c < 0x80)
+        return 1;
+    if (c >= 0xC2 && c <= 0xDF)
+        *pending = 1;
+    else if (c >= 0xE0 && c <= 0xEF)
+        *pending = 2;
+    else if (c >= 0xF0 && c <= 0xF4)
+        *pending = 3;
+    else
+        return 0;
+    return 1;
+}
+
+
+/* Stores the UTF-8 encoding of codepoint in bytes, and returns its length */
+int utf8_encode(uint32_t codepoint, unsigned char *bytes) {
+    if (codepoint < 0x80) {
+        bytes[0] = codepoint;
+        return 1;
+    } else if (codepoint < 0x800) {
+        bytes[0] = 0xC0 | (codepoint >> 6);
+        bytes[1] = 0x80 | (codepoint & 0x3F);
+        return 2;
+    } else if (codepoint < 0x10000) {
+        bytes[0] = 0xE0 | (codepoint >> 12);
+        bytes[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+        bytes[2] = 0x80 | (codepoint & 0x3F);
+        return 3;
+    }
+    bytes[0] = 0xF0 | (codepoint >> 18);
+    bytes[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+    bytes[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+    bytes[3] = 0x80 | (codepoint & 0x3F);
+    return 4;
+}
+
+
+void init_codepoint_set(codepoint_set_t *set) {
+    set->ranges = NULL;
+    set->count = 0;
+    set->capacity = 0;
+}
+
+
+void free_codepoint_set(codepoint_set_t *set) {
+    free(set->ranges);
+    init_codepoint_set(set);
+}
+
+
+void add_codepoint_range(codepoint_set_t *set, uint32_t lo, uint32_t hi) {
+    if (set->count == set->capacity) {
+        set->capacity = (set->capacity == 0) ? 8 : set->capacity * 2;
+        set->ranges = realloc(set->ranges, sizeof(codepoint_range_t) * set->capacity);
+    }
+    set->ranges[set->count].lo = lo;
+    set->ranges[set->count].hi = hi;
+    set->count++;
+}
+
+
+int compare_codepoint_ranges(const void *a, const void *b) {
+    uint32_t lo_a = ((codepoint_range_t *)a)->lo, lo_b = ((codepoint_range_t *)b)->lo;
+    return (lo_a > lo_b) - (lo_a < lo_b);
+}
+
+
+/* Sorts the ranges, and merges those which overlap or are adjacent */
+void normalize_codepoint_set(codepoint_set_t *set) {
+    size_t i, merged = 0;
+    if (set->count == 0)
+        return;
+    qsort(set->ranges, set->count, sizeof(codepoint_range_t), &compare_codepoint_ranges);
+    for (i = 1; i < set->count; i++) {
+        if (set->ranges[i].lo <= set->ranges[merged].hi + 1) {
+            if (set->ranges[i].hi > set->ranges[merged].hi)
+                set->ranges[merged].hi = set->ranges[i].hi;
+        } else {
+            set->ranges[++merged] = set->ranges[i];
+        }
+    }
+    set->count = merged + 1;
+}
+
+
+/* Adds the other case of every ASCII letter in the set, matching the case
+ * folding of bytes done for single byte symbols */
+void fold_codepoint_set(codepoint_set_t *set) {
+    size_t i, count = set->count;
+    uint32_t lo, hi;
+    for (i = 0; i < count; i++) {
+        lo = (set->ranges[i].lo < 'A') ? 'A' : set->ranges[i].lo;
+        hi = (set->ranges[i].hi > 'Z') ? 'Z' : set->ranges[i].hi;
+        if (lo <= hi)
+            add_codepoint_range(set, lo | 0x20, hi | 0x20);
+        lo = (set->ranges[i].lo < 'a') ? 'a' : set->ranges[i].lo;
+        hi = (set->ranges[i].hi > 'z') ? 'z' : set->ranges[i].hi;
+        if (lo <= hi)
+            add_codepoint_range(set, lo & ~0x20, hi & ~0x20);
+    }
+    normalize_codepoint_set(set);
+}
+
+
+/* Replaces the normalized set with every other code point which has a UTF-8
+ * encoding, other than '\0', which never matches */
+void negate_codepoint_set(codepoint_set_t *set) {
+    codepoint_set_t negated;
+    uint32_t next = 1;
+    size_t i;
+    init_codepoint_set(&negated);
+    for (i = 0; i < set->count; i++) {
+        if (set->ranges[i].lo > next)
+            add_codepoint_range(&negated, next, set->ranges[i].lo - 1);
+        if (set->ranges[i].hi + 1 > next)
+            next = set->ranges[i].hi + 1;
+    }
+    if (next <= UTF8_MAX_CODEPOINT)
+        add_codepoint_range(&negated, next, UTF8_MAX_CODEPOINT);
+    free(set->ranges);
+    *set = negated;
+}
+
+
+void add_utf8_sequence(utf8_sequence_t **sequences, size_t *count, size_t *capacity,
+                       uint32_t lo, uint32_t hi) {
+    unsigned char lo_bytes[UTF8_MAX_BYTES], hi_bytes[UTF8_MAX_BYTES];
+    int i, len;
+    if (*count == *capacity) {
+        *capacity = (*capacity == 0) ? 16 : *capacity * 2;
+        *sequences = realloc(*sequences, sizeof(utf8_sequence_t) * (*capacity));
+    }
+    len = utf8_encode(lo, lo_bytes);
+    utf8_encode(hi, hi_bytes);
+    for (i = 0; i < len; i++) {
+        (*sequences)[*count].lo[i] = lo_bytes[i];
+        (*sequences)[*count].hi[i] = hi_bytes[i];
+    }
+    (*sequences)[*count].len = len;
+    (*count)++;
+}
+
+
+/* Splits the range lo-hi until each part's encodings differ only in their
+ * last bytes, or in a way that a range per byte describes exactly */
+void split_utf8_range(utf8_sequence_t **sequences, size_t *count, size_t *capacity,
+                      uint32_t lo, uint32_t hi) {
+    static const uint32_t length_limits[] = {0x7F, 0x7FF, 0xFFFF};
+    uint32_t mask;
+    int i;
+    if (lo < SURROGATE_LO && hi > SURROGATE_HI) {
+        split_utf8_range(sequences, count, capacity, lo, SURROGATE_LO - 1);
+        split_utf8_range(sequences, count, capacity, SURROGATE_HI + 1, hi);
+        return;
+    }
+    if (lo >= SURROGATE_LO && hi <= SURROGATE_HI)
+        return;
+    if (lo >= SURROGATE_LO && lo <= SURROGATE_HI)
+        lo = SURROGATE_HI + 1;
+    if (hi >= SURROGATE_LO && hi <= SURROGATE_HI)
+        hi = SURROGATE_LO - 1;
+    /* encodings of different lengths */
+    for (i = 0; i < 3; i++) {
+        if (lo <= length_limits[i] && hi > length_limits[i]) {
+            split_utf8_range(sequences, count, capacity, lo, length_limits[i]);
+            split_utf8_range(sequences, count, capacity, length_limits[i] + 1, hi);
+            return;
+        }
+    }
+    if (hi < 0x80) {
+        add_utf8_sequence(sequences, count, capacity, lo, hi);
+        return;
+    }
+    /* continuation bytes which do not span their whole range, other than
+     * in the first byte which differs */
+    for (i = 1; i < UTF8_MAX_BYTES; i++) {
+        mask = (1 << (6 * i)) - 1;
+        if ((lo & ~mask) != (hi & ~mask)) {
+            if ((lo & mask) != 0) {
+                split_utf8_range(sequences, count, capacity, lo, lo | mask);
+                split_utf8_range(sequences, count, capacity, (lo | mask) + 1, hi);
+                return;
+            }
+            if ((hi & mask) != mask) {
+                split_utf8_range(sequences, count, capacity, lo, (hi & ~mask) - 1);
+                split_utf8_range(sequences, count, capacity, hi & ~mask, hi);
+                return;
+            }
+        }
+    }
+    add_utf8_sequence(sequences, count, capacity, lo, hi);
+}
+
+
+/* Converts the normalized set into sequences of byte ranges which together
+ * match the UTF-8 encoding of exactly the code points in the set. Stores
+ * the array, to be freed by the caller, in sequences, and returns its
+ * length. */
+size_t utf8_sequences(codepoint_set_t *set, utf8_sequence_t **sequences) {
+    size_t i, count = 0, capacity = 0;
+    *sequences = NULL;
+    for (i = 0; i < set->count; i++)
+        split_utf8_range(sequences, &count, &capacity, set->ranges[i].lo, set->ranges[i].hi);
+    return count;
+}